@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include <utils/database.h>
+#include <utils/responses.cpp>
+#include <utils/storage.cpp>
+
+#include "seed.cpp"
+
+// Runs fn until at least minimum time has passed and prints the time per call
+void benchmark(const std::string &name, std::function<void()> fn, uintmax_t bytes = 0, std::chrono::milliseconds minimum = std::chrono::milliseconds(1000)) {
+	fn();
+
+	uint64_t iterations = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = std::chrono::steady_clock::duration::zero();
+
+	while (elapsed < minimum) {
+		fn();
+		iterations++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	}
+
+	double nanoseconds = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+
+	if (bytes) {
+		printf("%-40s %12.0f ns/op %10llu iterations %10.1f MiB/s\n", name.c_str(), nanoseconds, (unsigned long long)iterations, (double)bytes / nanoseconds * 1e9 / (1024 * 1024));
+	} else {
+		printf("%-40s %12.0f ns/op %10llu iterations\n", name.c_str(), nanoseconds, (unsigned long long)iterations);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	auto directory = std::filesystem::temp_directory_path() / ("papyrus_bench_" + std::to_string(getpid()));
+	std::filesystem::create_directories(directory);
+
+	auto database = DB((directory / "database.sqlite").string());
+	migrate(database.get());
+
+	Seeder(database).seed({ "paper" }, 1, 500, 3, std::string(32, '0'));
+
+	benchmark("DB::query latest build", [&database]() {
+		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND (build = ? OR ? = 'latest') AND ready = 1 ORDER BY id DESC LIMIT 1");
+		query.bind(1, "paper");
+		query.bind(2, "1.20.0");
+		query.bind(3, "latest");
+		query.bind(4, "latest");
+
+		database.query(query);
+	});
+
+	benchmark("DB::query 500 builds", [&database]() {
+		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND ready = 1 ORDER BY id ASC");
+		query.bind(1, "paper");
+		query.bind(2, "1.20.0");
+
+		database.query(query);
+	});
+
+	benchmark("Responses::build latest", [&database]() {
+		Responses::build(database, "paper", "1.20.0", "latest");
+	});
+
+	benchmark("Responses::builds 500 builds", [&database]() {
+		Responses::builds(database, "paper", "1.20.0");
+	});
+
+	auto listing = Responses::builds(database, "paper", "1.20.0").value();
+	auto dumped = listing.dump();
+
+	benchmark("json::dump 500 builds", [&listing]() {
+		listing.dump();
+	}, dumped.size());
+
+	auto storage = Storage((directory / "storage").string());
+
+	for (uintmax_t size : { (uintmax_t)1024 * 1024, (uintmax_t)64 * 1024 * 1024 }) {
+		std::string name = "input";
+		std::vector<char> chunk(1024 * 1024);
+
+		for (size_t i = 0; i < chunk.size(); i++) {
+			chunk[i] = (char)(i * 2654435761u >> 24);
+		}
+
+		{
+			auto stream = storage.store(name);
+			for (uintmax_t written = 0; written < size; written += chunk.size()) {
+				stream.write(chunk.data(), chunk.size());
+			}
+		}
+
+		std::string md5 = storage.finalize(name)["md5"];
+
+		benchmark("Storage::finalize " + std::to_string(size / (1024 * 1024)) + " MiB", [&storage, &name, &md5]() {
+			std::filesystem::rename(storage.get() + "/" + md5, storage.get() + "/" + name);
+			storage.finalize(name);
+		}, size);
+
+		storage.remove(md5);
+	}
+
+	std::filesystem::remove_all(directory);
+
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include <utils/database.h>
+#include <utils/storage.cpp>
+
+#include "seed.cpp"
+
+#ifndef PAPYRUS_BINARY
+#define PAPYRUS_BINARY "./Papyrus"
+#endif
+
+using json = nlohmann::json;
+
+// Blocking HTTP/1.1 client over a single keep-alive connection
+class Connection {
+private:
+	int _socket = -1;
+	int _port;
+	std::string _buffer;
+
+	bool connect() {
+		_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+		int yes = 1;
+		setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+		sockaddr_in address {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(_port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (::connect(_socket, (sockaddr *)&address, sizeof(address)) != 0) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close() {
+		if (_socket >= 0) {
+			::close(_socket);
+		}
+
+		_socket = -1;
+		_buffer.clear();
+	}
+
+	bool fill() {
+		char chunk[64 * 1024];
+		ssize_t received = recv(_socket, chunk, sizeof(chunk), 0);
+		if (received <= 0) {
+			return false;
+		}
+
+		_buffer.append(chunk, received);
+		return true;
+	}
+public:
+	struct Response {
+		int status = 0;
+		std::string body;
+	};
+
+	Connection(int port) : _port(port) {}
+
+	~Connection() {
+		close();
+	}
+
+	std::optional<Response> request(const std::string &method, const std::string &path, const std::string &body = "", const std::string &authorization = "") {
+		if (_socket < 0 && !connect()) {
+			return std::nullopt;
+		}
+
+		std::string request = method + " " + path + " HTTP/1.1\r\nHost: localhost\r\n";
+		if (!authorization.empty()) {
+			request += "Authorization: " + authorization + "\r\n";
+		}
+		if (method != "GET") {
+			request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+		}
+		request += "\r\n";
+		request += body;
+
+		for (size_t sent = 0; sent < request.size();) {
+			ssize_t written = send(_socket, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+			if (written <= 0) {
+				close();
+				return std::nullopt;
+			}
+
+			sent += written;
+		}
+
+		size_t end;
+		while ((end = _buffer.find("\r\n\r\n")) == std::string::npos) {
+			if (!fill()) {
+				close();
+				return std::nullopt;
+			}
+		}
+
+		Response response;
+		std::string head = _buffer.substr(0, end);
+		_buffer.erase(0, end + 4);
+
+		response.status = std::stoi(head.substr(head.find(' ') + 1, 3));
+
+		size_t length = 0;
+		std::string lower = head;
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+		auto header = lower.find("\r\ncontent-length:");
+		if (header != std::string::npos) {
+			length = std::stoull(lower.substr(header + 17));
+		}
+
+		while (_buffer.size() < length) {
+			if (!fill()) {
+				close();
+				return std::nullopt;
+			}
+		}
+
+		response.body = _buffer.substr(0, length);
+		_buffer.erase(0, length);
+
+		return response;
+	}
+};
+
+class Recorder {
+private:
+	std::mutex _mutex;
+	std::map<std::string, std::vector<double>> _latencies;
+	std::map<std::string, uint64_t> _errors;
+public:
+	void record(const std::string &workload, std::chrono::steady_clock::duration duration, bool ok) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (ok) {
+			_latencies[workload].push_back(std::chrono::duration<double, std::micro>(duration).count());
+		} else {
+			_errors[workload]++;
+		}
+	}
+
+	void report(double seconds) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		printf("%-10s %10s %10s %10s %10s %10s %8s\n", "workload", "requests", "req/s", "p50 us", "p99 us", "p999 us", "errors");
+
+		uint64_t total = 0;
+		for (auto &[workload, latencies] : _latencies) {
+			std::sort(latencies.begin(), latencies.end());
+
+			auto percentile = [&latencies](double p) {
+				return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+			};
+
+			printf("%-10s %10zu %10.0f %10.0f %10.0f %10.0f %8llu\n", workload.c_str(), latencies.size(), latencies.size() / seconds, percentile(0.5), percentile(0.99), percentile(0.999), (unsigned long long)_errors[workload]);
+			total += latencies.size();
+		}
+
+		printf("%-10s %10llu %10.0f\n", "total", (unsigned long long)total, total / seconds);
+	}
+};
+
+int main(int argc, char *argv[]) {
+	std::map<std::string, std::string> arguments;
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+		arguments[argument.substr(0, argument.find("="))] = argument.substr(argument.find("=") + 1);
+	}
+
+	auto get = [&arguments](const std::string &key, const std::string &fallback) {
+		return arguments.count(key) ? arguments[key] : fallback;
+	};
+
+	int threads = std::stoi(get("threads", "8"));
+	int seconds = std::stoi(get("duration", "10"));
+	int port = std::stoi(get("port", "38080"));
+	std::string binary = get("binary", PAPYRUS_BINARY);
+
+	auto directory = std::filesystem::temp_directory_path() / ("papyrus_load_" + std::to_string(getpid()));
+	std::filesystem::create_directories(directory);
+
+	auto storage = Storage((directory / "storage").string());
+	std::string artifact(4 * 1024 * 1024, '\0');
+	for (size_t i = 0; i < artifact.size(); i++) {
+		artifact[i] = (char)(i * 2654435761u >> 24);
+	}
+
+	{
+		auto stream = storage.store("artifact");
+		stream.write(artifact.data(), artifact.size());
+	}
+
+	auto md5 = storage.finalize("artifact")["md5"];
+
+	{
+		auto database = DB((directory / "database.sqlite").string());
+		migrate(database.get());
+
+		Seeder(database).seed({ "paper", "velocity" }, 10, 200, 3, md5);
+	}
+
+	printf("seeded %s\n", directory.c_str());
+
+	pid_t server = fork();
+	if (server == 0) {
+		std::string keyArgument = "key=load";
+		std::string portArgument = "port=" + std::to_string(port);
+		std::string databaseArgument = "database=" + (directory / "database.sqlite").string();
+		std::string storageArgument = "storage=" + storage.get();
+
+		execl(binary.c_str(), binary.c_str(), keyArgument.c_str(), portArgument.c_str(), databaseArgument.c_str(), storageArgument.c_str(), (char *)nullptr);
+		perror("execl");
+		_exit(1);
+	}
+
+	bool ready = false;
+	for (int attempt = 0; attempt < 100 && !ready; attempt++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		ready = Connection(port).request("GET", "/v2").has_value();
+	}
+
+	if (!ready) {
+		fprintf(stderr, "server did not come up on port %d\n", port);
+		kill(server, SIGTERM);
+		waitpid(server, nullptr, 0);
+		std::filesystem::remove_all(directory);
+		return 1;
+	}
+
+	Recorder recorder;
+	std::atomic<bool> running{true};
+	std::vector<std::thread> workers;
+
+	std::string upload(1024 * 1024, 'u');
+
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			Connection connection(port);
+			std::mt19937 random(t);
+			int uploads = 0;
+
+			while (running.load(std::memory_order_relaxed)) {
+				std::string project = random() % 2 ? "paper" : "velocity";
+				std::string version = "1." + std::to_string(20 + random() % 2) + "." + std::to_string(random() % 5);
+				int pick = random() % 100;
+
+				auto start = std::chrono::steady_clock::now();
+
+				if (pick < 40) {
+					auto response = connection.request("GET", "/v2/" + project + "/" + version);
+					recorder.record("listing", std::chrono::steady_clock::now() - start, response && response->status == 200);
+				} else if (pick < 80) {
+					auto response = connection.request("GET", "/v2/" + project + "/" + version + "/latest");
+					recorder.record("latest", std::chrono::steady_clock::now() - start, response && response->status == 200);
+				} else if (pick < 95) {
+					auto response = connection.request("GET", "/v2/" + project + "/" + version + "/latest/download");
+					recorder.record("download", std::chrono::steady_clock::now() - start, response && response->status == 200 && response->body.size() == artifact.size());
+				} else {
+					auto build = json::object();
+
+					build["project"] = project;
+					build["version"] = version;
+					build["fileExtension"] = "jar";
+					build["build"] = "load-" + std::to_string(t) + "-" + std::to_string(uploads++);
+					build["result"] = "SUCCESS";
+					build["timestamp"] = 1700000000000L;
+					build["duration"] = 1000;
+					build["commits"] = json::array();
+					build["metadata"] = json::object();
+
+					auto created = connection.request("POST", "/v2/create", build.dump(), "load");
+					bool ok = created && created->status == 200;
+
+					if (ok) {
+						std::string id = json::parse(created->body)["id"];
+						auto uploaded = connection.request("POST", "/v2/create/upload/" + id, upload, "load");
+						ok = uploaded && uploaded->status == 200;
+					}
+
+					recorder.record("upload", std::chrono::steady_clock::now() - start, ok);
+				}
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	running.store(false);
+
+	for (auto &worker : workers) {
+		worker.join();
+	}
+
+	recorder.report(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	kill(server, SIGTERM);
+	waitpid(server, nullptr, 0);
+
+	std::filesystem::remove_all(directory);
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <string>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+#include <nlohmann/json.hpp>
+
+#include <utils/database.h>
+
+#ifndef SEED_CPP
+#define SEED_CPP
+
+// Fills a database with ready builds shaped like the ones our CI uploads
+class Seeder {
+private:
+	DB &_database;
+public:
+	Seeder(DB &database) : _database(database) {}
+
+	void seed(const std::vector<std::string> &projects, int versions, int builds, int commits, const std::string &md5) {
+		SQLite::Transaction transaction(_database.get());
+
+		auto metadata = nlohmann::json::object();
+		metadata["channel"] = "default";
+		metadata["java"] = { { "minimum", 21 } };
+
+		for (auto &project : projects) {
+			SQLite::Statement query(_database.get(), "INSERT INTO projects (name) VALUES (?) ON CONFLICT DO NOTHING;");
+			query.bind(1, project);
+			_database.exec(query);
+
+			for (int v = 0; v < versions; v++) {
+				std::string version = "1." + std::to_string(20 + v / 5) + "." + std::to_string(v % 5);
+
+				query = SQLite::Statement(_database.get(), "INSERT INTO versions (project_id, name) VALUES ((SELECT id FROM projects WHERE name = ?), ?) ON CONFLICT DO NOTHING;");
+				query.bind(1, project);
+				query.bind(2, version);
+				_database.exec(query);
+
+				for (int b = 1; b <= builds; b++) {
+					query = SQLite::Statement(_database.get(), "INSERT INTO builds (version_id, ready, file_extension, build, result, timestamp, duration, commits, metadata, md5, sha256, sha512) VALUES ((SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?), 1, 'jar', ?, 'SUCCESS', ?, ?, '[]', ?, ?, ?, ?) RETURNING id;");
+					query.bind(1, project);
+					query.bind(2, version);
+					query.bind(3, std::to_string(b));
+					query.bind(4, 1700000000000L + b * 60000L);
+					query.bind(5, 90000 + b);
+					query.bind(6, metadata.dump());
+					query.bind(7, md5);
+					query.bind(8, std::string(64, 'a'));
+					query.bind(9, std::string(128, 'b'));
+
+					auto id = std::stoi(_database.query(query).front()["id"]);
+
+					query = SQLite::Statement(_database.get(), "INSERT INTO commits (build_id, author, email, description, hash, timestamp, raw) VALUES (?, ?, ?, ?, ?, ?, ?);");
+
+					for (int c = 0; c < commits; c++) {
+						auto commit = nlohmann::json::object();
+
+						commit["author"] = "Developer " + std::to_string(c);
+						commit["email"] = "dev" + std::to_string(c) + "@example.com";
+						commit["description"] = "Fix something important in " + project + " (#" + std::to_string(id * 10 + c) + ")";
+						commit["hash"] = project + "-" + std::to_string(id) + "-" + std::to_string(c);
+						commit["timestamp"] = 1700000000000L + id * 1000L + c;
+
+						query.bind(1, id);
+						query.bind(2, commit["author"].get<std::string>());
+						query.bind(3, commit["email"].get<std::string>());
+						query.bind(4, commit["description"].get<std::string>());
+						query.bind(5, commit["hash"].get<std::string>());
+						query.bind(6, commit["timestamp"].get<int64_t>());
+						query.bind(7, commit.dump());
+
+						_database.exec(query);
+						query.reset();
+					}
+				}
+			}
+		}
+
+		transaction.commit();
+	}
+};
+
+#endif // SEED_CPP
@@ -3,8 +3,13 @@
 #include <nlohmann/json.hpp>
 
 #include <utils/database.h>
+#include <utils/exchange.cpp>
+#include <utils/exporter.cpp>
+#include <utils/responses.cpp>
 #include <utils/logger.cpp>
+#include <utils/reconciler.cpp>
 #include <utils/storage.cpp>
+#include <utils/trace.cpp>
 
 using json = nlohmann::json;
 
@@ -32,19 +37,148 @@ public:
 	}
 };
 
+struct Download {
+	Storage::Reader reader;
+	uintmax_t size = 0;
+	std::shared_ptr<Exchange> exchange;
+	Histogram *reads = nullptr;
+
+	// the chunk currently being sent and the write offset it started at
+	char buffer[16 * 1024];
+	std::streamsize length = 0;
+	uintmax_t offset = 0;
+
+	// when the socket last refused a write, 0 while it is accepting them
+	int64_t stalled = 0;
+};
+
+// Whether an Accept-Encoding header allows a gzip response body
+bool acceptsGzip(std::string_view header) {
+	bool wildcard = false;
+
+	while (!header.empty()) {
+		auto end = header.find(',');
+		auto coding = header.substr(0, end);
+		header = end == std::string_view::npos ? std::string_view() : header.substr(end + 1);
+
+		auto parameters = coding.find(';');
+		auto trimmed = coding.substr(0, parameters);
+		trimmed.remove_prefix(std::min(trimmed.find_first_not_of(" \t"), trimmed.size()));
+
+		// codings are case-insensitive
+		std::string name(trimmed.substr(0, trimmed.find_last_not_of(" \t") + 1));
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+		// q=0 (or 0.0, 0.000) refuses the coding
+		bool refused = false;
+		auto q = parameters == std::string_view::npos ? std::string_view::npos : coding.find("q=", parameters);
+		if (q != std::string_view::npos) {
+			auto value = coding.substr(q + 2);
+			value = value.substr(0, value.find_first_of(" \t;"));
+			refused = !value.empty() && value.find_first_not_of("0.") == std::string_view::npos;
+		}
+
+		if (name == "gzip" || name == "x-gzip") {
+			return !refused;
+		}
+
+		if (name == "*") {
+			wildcard = !refused;
+		}
+	}
+
+	return wildcard;
+}
+
+// Sends the file until the socket applies backpressure, returns true once nothing is left to wait for
+template <typename Response>
+bool pump(Response *res, std::shared_ptr<Download> download) {
+	auto &tracer = Tracer::get();
+
+	Tracer::request(download->exchange->id());
+
+	if (download->stalled) {
+		tracer.record("write.backpressure", download->exchange->id(), download->stalled, tracer.now());
+		download->stalled = 0;
+	}
+
+	Span span("write");
+
+	while (!download->exchange->finished()) {
+		if (!download->length && res->getWriteOffset() < download->size) {
+			Stopwatch stopwatch(*download->reads);
+
+			download->length = download->reader.read(download->buffer, sizeof(download->buffer));
+			download->offset = res->getWriteOffset();
+
+			if (!download->length) {
+				// the file is shorter than announced, the response can never complete
+				download->exchange->finish(500, res->getWriteOffset());
+				res->close();
+
+				return true;
+			}
+		}
+
+		auto written = res->getWriteOffset() - download->offset;
+		auto [ok, done] = res->tryEnd(std::string_view(download->buffer + written, download->length - written), download->size);
+
+		if (done) {
+			download->exchange->finish(200, download->size);
+			return true;
+		}
+
+		if (!ok) {
+			download->exchange->metrics().stalls.fetch_add(1, std::memory_order_relaxed);
+			download->stalled = tracer.enabled() ? tracer.now() : 0;
+
+			return false;
+		}
+
+		download->length = 0;
+	}
+
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	auto arguments = Arguments(argc, argv);
 
+	// the signal mask is inherited, so this has to happen before any other thread starts
+	Tracer::get().configure(arguments.get("trace").value_or("false") == "true", std::stoull(arguments.get("trace_buffer").value_or("65536")));
+	Tracer::get().dumpOnSignal(arguments.get("trace_dump").value_or("trace.json"), [](const std::string &path) {
+		Logger::level(Level::INFO).log("Wrote trace to " + path);
+	});
+
+	Logger::sink().configure(
+		Logger::parse(arguments.get("log_level").value_or("info")),
+		arguments.get("log").value_or(""),
+		arguments.get("access_log").value_or(""),
+		std::stoull(arguments.get("log_max_size").value_or("67108864")),
+		std::stoi(arguments.get("log_files").value_or("5"))
+	);
+
 	auto database = DB(arguments.get("database").value_or("database.sqlite"));
-	auto storage = Storage(arguments.get("storage").value_or("storage"));
+	auto storage = Storage(arguments.get("storage").value_or("storage"), arguments.get("compress").value_or("false") == "true");
 
 	auto app = uWS::App();
+	auto metrics = Metrics();
+	auto admission = Admission(metrics);
+
+	admission.limit(Admission::Class::UPLOAD, std::stoll(arguments.get("max_uploads").value_or("0")));
+	admission.limit(Admission::Class::DOWNLOAD, std::stoll(arguments.get("max_downloads").value_or("0")));
+	admission.limit(Admission::Class::SUBSCRIBE, std::stoll(arguments.get("max_subscribers").value_or("0")));
+	admission.rate(std::stod(arguments.get("rate").value_or("0")), std::stod(arguments.get("burst").value_or(arguments.get("rate").value_or("0"))));
 
 	migrate(database.get());
 
+	database.observe([&metrics](const std::string &sql, std::chrono::nanoseconds duration) {
+		metrics.query(sql).observe(duration);
+	});
+
 	auto key = arguments.get("key");
 	if (!key.has_value()) {
-		Logger::color(Color::RED).log("Missing key argument");
+		Logger::level(Level::ERROR).log("Missing key argument");
 		return 1;
 	}
 
@@ -55,21 +189,36 @@ int main(int argc, char *argv[]) {
 		}
 	});
 
-	app.any("/*", [](auto *res, auto *req) {
-		res->cork([res]() {
-			res->writeStatus("404 Not Found");
-			res->writeHeader("Content-Type", "application/json");
-			res->end("{\"error\": \"Endpoint not found\"}");
-		});
-	});
+	// checks storage against the database in the background, the listener is already up
+	Reconciler::Options options;
+
+	options.threads = std::stoul(arguments.get("reconcile_threads").value_or("2"));
+	options.interval = std::chrono::seconds(std::stoll(arguments.get("reconcile_interval").value_or("21600")));
+	options.grace = std::chrono::seconds(std::stoll(arguments.get("reconcile_grace").value_or("86400")));
+	options.verifyRate = std::stod(arguments.get("verify_rate").value_or("0")) * 1024 * 1024;
 
-	app.post("/v2/create", [&database, key](auto *res, auto *req) {
+	std::unique_ptr<Reconciler> reconciler;
+
+	if (arguments.get("reconcile").value_or("true") == "true") {
+		reconciler = std::make_unique<Reconciler>(arguments.get("database").value_or("database.sqlite"), storage, metrics, options);
+		reconciler->start();
+	}
+
+	// static copy of the read API, refreshed for whatever the write routes below change
+	std::unique_ptr<Exporter> exporter;
+
+	if (arguments.get("export").has_value()) {
+		exporter = std::make_unique<Exporter>(arguments.get("database").value_or("database.sqlite"), storage, arguments.get("export").value());
+		exporter->start();
+	}
+
+	app.any("/*", instrument(metrics, admission, "ANY /*", [](auto *res, auto *req, auto exchange) {
+		respond(res, *exchange, "404 Not Found", "{\"error\": \"Endpoint not found\"}");
+	}));
+
+	app.post("/v2/create", instrument(metrics, admission, "POST /v2/create", [&database, &exporter, key](auto *res, auto *req, auto exchange) {
 		if (req->getHeader("authorization") != key) {
-			res->cork([res]() {
-				res->writeStatus("401 Unauthorized");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Unauthorized\"}");
-			});
+			respond(res, *exchange, "401 Unauthorized", "{\"error\": \"Unauthorized\"}");
 
 			return;
 		}
@@ -83,15 +232,21 @@ int main(int argc, char *argv[]) {
 
 		std::shared_ptr<RequestContext> context = std::make_shared<RequestContext>();
 
-		res->onAborted([context]() {
+		res->onAborted([context, exchange]() {
 			context->closed = true;
+			exchange->abort();
 		});
 
-		res->onData([&database, res, context](std::string_view chunk, bool last) {
+		res->onData([&database, &exporter, res, context, exchange](std::string_view chunk, bool last) {
+			Tracer::request(exchange->id());
+
+			exchange->received(chunk.size());
 			context->body->append(std::string(chunk));
 
 			if (last) {
 				try {
+					Span parsing("json.parse");
+
 					auto data = json::parse(std::string(context->body->c_str()));
 
 					// validate data
@@ -100,41 +255,47 @@ int main(int argc, char *argv[]) {
 							return;
 						}
 
-						res->cork([res]() {
-							res->writeStatus("400 Bad Request");
-							res->writeHeader("Content-Type", "application/json");
-							res->end("{\"error\": \"Missing Required Fields\"}");
-						});
+						respond(res, *exchange, "400 Bad Request", "{\"error\": \"Missing Required Fields\"}");
 
 						return;
 					}
 
 					for (auto commit : data["commits"]) {
-						if (!commit.contains("author") || !commit.contains("email") || !commit.contains("description") || !commit.contains("hash") || !commit.contains("timestamp")) {
+						if (!commit.contains("author") || !commit.contains("email") || !commit.contains("description") || !commit.contains("hash") || !commit.contains("timestamp") || !commit["author"].is_string() || !commit["email"].is_string() || !commit["description"].is_string() || !commit["hash"].is_string()) {
 							if (context->closed) {
 								return;
 							}
 
-							res->cork([res]() {
-								res->writeStatus("400 Bad Request");
-								res->writeHeader("Content-Type", "application/json");
-								res->end("{\"error\": \"Invalid Commit\"}");
-							});
+							respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid Commit\"}");
 
 							return;
 						}
 					}
 
+					// GET /v2/:project/commit/:hash would shadow the version
+					if (data["version"] == "commit") {
+						if (context->closed) {
+							return;
+						}
+
+						respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid Version\"}");
+
+						return;
+					}
+
+					parsing.end();
+					Span resolve("db.resolve");
+
 					SQLite::Statement query(database.get(), "INSERT INTO projects (name) VALUES (?) ON CONFLICT DO NOTHING;");
 					query.bind(1, data["project"].get<std::string>());
 
-					database.get().exec(query.getExpandedSQL());
+					database.exec(query);
 
 					query = SQLite::Statement(database.get(), "INSERT INTO versions (project_id, name) VALUES ((SELECT id FROM projects WHERE name = ?), ?) ON CONFLICT DO NOTHING;");
 					query.bind(1, data["project"].get<std::string>());
 					query.bind(2, data["version"].get<std::string>());
 
-					database.get().exec(query.getExpandedSQL());
+					database.exec(query);
 
 					query = SQLite::Statement(database.get(), "SELECT id FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND build = ?;");
 					query.bind(1, data["project"].get<std::string>());
@@ -147,16 +308,18 @@ int main(int argc, char *argv[]) {
 							return;
 						}
 
-						res->cork([res]() {
-							res->writeStatus("400 Bad Request");
-							res->writeHeader("Content-Type", "application/json");
-							res->end("{\"error\": \"Build Already Exists\"}");
-						});
+						respond(res, *exchange, "400 Bad Request", "{\"error\": \"Build Already Exists\"}");
 
 						return;
 					}
 
-					query = SQLite::Statement(database.get(), "INSERT INTO builds (version_id, ready, file_extension, build, result, timestamp, duration, commits, metadata, md5, sha256, sha512) VALUES ((SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?), 0, ?, ?, ?, ?, ?, ?, ?, '', '', '') RETURNING id;");
+					resolve.end();
+					Span write("db.write");
+
+					SQLite::Transaction transaction(database.get());
+
+					// commits are kept in their own table, the column only stays for older databases
+					query = SQLite::Statement(database.get(), "INSERT INTO builds (version_id, ready, file_extension, build, result, timestamp, duration, commits, metadata, md5, sha256, sha512, created) VALUES ((SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?), 0, ?, ?, ?, ?, ?, '[]', ?, '', '', '', ?) RETURNING id;");
 					query.bind(1, data["project"].get<std::string>());
 					query.bind(2, data["version"].get<std::string>());
 					query.bind(3, data["fileExtension"].get<std::string>());
@@ -164,8 +327,8 @@ int main(int argc, char *argv[]) {
 					query.bind(5, data["result"].get<std::string>());
 					query.bind(6, data["timestamp"].get<long>());
 					query.bind(7, data["duration"].get<int>());
-					query.bind(8, data["commits"].dump());
-					query.bind(9, data["metadata"].dump());
+					query.bind(8, data["metadata"].dump());
+					query.bind(9, (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
 
 					auto insert = database.query(query);
 					if (!insert.size()) {
@@ -173,17 +336,36 @@ int main(int argc, char *argv[]) {
 							return;
 						}
 
-						res->cork([res]() {
-							res->writeStatus("500 Internal Server Error");
-							res->writeHeader("Content-Type", "application/json");
-							res->end("{\"error\": \"Failed to Create Build\"}");
-						});
+						respond(res, *exchange, "500 Internal Server Error", "{\"error\": \"Failed to Create Build\"}");
 
 						return;
 					}
 
 					auto build = insert.front();
 
+					query = SQLite::Statement(database.get(), "INSERT INTO commits (build_id, author, email, description, hash, timestamp, raw) VALUES (?, ?, ?, ?, ?, ?, ?);");
+
+					for (auto commit : data["commits"]) {
+						query.bind(1, std::stoi(build["id"]));
+						query.bind(2, commit["author"].get<std::string>());
+						query.bind(3, commit["email"].get<std::string>());
+						query.bind(4, commit["description"].get<std::string>());
+						query.bind(5, commit["hash"].get<std::string>());
+						// any timestamp is accepted and returned as sent, only integers are kept for sorting
+						query.bind(6, commit["timestamp"].is_number_integer() ? commit["timestamp"].get<int64_t>() : 0);
+						query.bind(7, commit.dump());
+
+						database.exec(query);
+						query.reset();
+					}
+
+					transaction.commit();
+					write.end();
+
+					if (exporter) {
+						exporter->project(data["project"]);
+					}
+
 					if (context->closed) {
 						return;
 					}
@@ -192,32 +374,35 @@ int main(int argc, char *argv[]) {
 
 					json["id"] = build["id"];
 
-					res->cork([res, &json]() {
-						res->writeHeader("Content-Type", "application/json");
-						res->end(json.dump());
-					});
+					respond(res, *exchange, "200 OK", serialize(json));
 				} catch (json::parse_error &e) {
 					if (context->closed) {
 						return;
 					}
 
-					res->cork([res]() {
-						res->writeStatus("400 Bad Request");
-						res->writeHeader("Content-Type", "application/json");
-						res->end("{\"error\": \"Invalid JSON\"}");
-					});
+					respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid JSON\"}");
+				} catch (json::exception &e) {
+					// a field of the wrong type, anything written so far is rolled back
+					if (context->closed) {
+						return;
+					}
+
+					respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid Field Type\"}");
+				} catch (SQLite::Exception &e) {
+					// the reconciler held the write lock for longer than the busy timeout
+					if (context->closed) {
+						return;
+					}
+
+					reject(res, *exchange, "503 Service Unavailable", "Database Busy", 1);
 				}
 			}
 		});
-	});
+	}));
 
-	app.post("/v2/create/upload/:build", [&database, &storage, key](auto *res, auto *req) {
+	app.post("/v2/create/upload/:build", instrument(metrics, admission, "POST /v2/create/upload/:build", [&app, &database, &storage, &exporter, key](auto *res, auto *req, auto exchange) {
 		if (req->getHeader("authorization") != key) {
-			res->cork([res]() {
-				res->writeStatus("401 Unauthorized");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Unauthorized\"}");
-			});
+			respond(res, *exchange, "401 Unauthorized", "{\"error\": \"Unauthorized\"}");
 
 			return;
 		}
@@ -225,28 +410,22 @@ int main(int argc, char *argv[]) {
 		std::string build = std::string(req->getParameter(0)).data();
 
 		if (build.find_first_not_of("0123456789") != std::string::npos) {
-			res->cork([res]() {
-				res->writeStatus("400 Bad Request");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Invalid Build\"}");
-			});
+			respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid Build\"}");
 
 			return;
 		}
 
 		int buildId = std::stoi(build);
 
+		Span resolve("db.resolve");
+
 		SQLite::Statement query(database.get(), "SELECT md5 FROM builds WHERE id = ?;");
 		query.bind(1, buildId);
 
 		auto results = database.query(query);
 
 		if (!results.size()) {
-			res->cork([res]() {
-				res->writeStatus("404 Not Found");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Build Not Found\"}");
-			});
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Build Not Found\"}");
 
 			return;
 		}
@@ -257,14 +436,12 @@ int main(int argc, char *argv[]) {
 			storage.remove(result["md5"]);
 		}
 
+		resolve.end();
+
 		auto stream = storage.store(build);
 
 		if (!stream.is_open()) {
-			res->cork([res]() {
-				res->writeStatus("500 Internal Server Error");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Failed to Store Build\"}");
-			});
+			respond(res, *exchange, "500 Internal Server Error", "{\"error\": \"Failed to Store Build\"}");
 
 			return;
 		}
@@ -273,8 +450,9 @@ int main(int argc, char *argv[]) {
 			int buildId;
 			bool closed;
 			std::ofstream stream;
+			int64_t receiving;
 
-			RequestContext() : buildId(0), closed(false), stream() {}
+			RequestContext() : buildId(0), closed(false), stream(), receiving(Tracer::get().now()) {}
 		};
 
 		std::shared_ptr<RequestContext> context = std::make_shared<RequestContext>();
@@ -282,26 +460,80 @@ int main(int argc, char *argv[]) {
 		context->buildId = buildId;
 		context->stream = std::move(stream);
 
-		res->onAborted([context]() {
+		auto writes = &exchange->metrics().storage("write");
+
+		res->onAborted([context, exchange]() {
 			context->closed = true;
 			context->stream.close();
+			exchange->abort();
 		});
 
-		res->onData([&database, &storage, res, context](std::string_view chunk, bool last) {
-			context->stream << chunk;
+		res->onData([&app, &database, &storage, &exporter, res, context, exchange, writes](std::string_view chunk, bool last) {
+			Tracer::request(exchange->id());
+
+			exchange->received(chunk.size());
+
+			{
+				Stopwatch stopwatch(*writes);
+				context->stream << chunk;
+			}
 
 			if (last) {
 				context->stream.close();
 
-				auto hashes = storage.finalize(std::to_string(context->buildId));
+				if (Tracer::get().enabled()) {
+					Tracer::get().record("upload.receive", exchange->id(), context->receiving, Tracer::get().now());
+				}
+
+				std::map<std::string, std::string> hashes;
+				{
+					Stopwatch stopwatch(exchange->metrics().storage("finalize"));
+					hashes = storage.finalize(std::to_string(context->buildId));
+				}
+
+				Span write("db.write");
+
+				try {
+					SQLite::Transaction transaction(database.get());
+
+					SQLite::Statement query(database.get(), "UPDATE builds SET ready = 1, md5 = ?, sha256 = ?, sha512 = ? WHERE id = ?;");
+					query.bind(1, hashes["md5"]);
+					query.bind(2, hashes["sha256"]);
+					query.bind(3, hashes["sha512"]);
+					query.bind(4, context->buildId);
+
+					// the reconciler removed the build while it was being uploaded, the file is left for its orphan cleanup
+					if (!database.exec(query)) {
+						write.end();
+
+						respond(res, *exchange, "404 Not Found", "{\"error\": \"Build Not Found\"}");
+
+						return;
+					}
+
+					// identical uploads share one file, so the row describes whatever finalize() stored last
+					if (!hashes["md5"].empty()) {
+						query = SQLite::Statement(database.get(), "INSERT OR REPLACE INTO artifacts (md5, size, encoding, stored_size, hash_version) VALUES (?, ?, ?, ?, ?);");
+						query.bind(1, hashes["md5"]);
+						query.bind(2, (int64_t)std::stoll(hashes["size"]));
+						query.bind(3, hashes["encoding"]);
+						query.bind(4, (int64_t)std::stoll(hashes["stored_size"]));
+						query.bind(5, Storage::hashVersion);
+
+						database.exec(query);
+					}
+
+					transaction.commit();
+				} catch (SQLite::Exception &e) {
+					// the reconciler held the write lock for longer than the busy timeout, the build stays pending
+					write.end();
 
-				SQLite::Statement query(database.get(), "UPDATE builds SET ready = 1, md5 = ?, sha256 = ?, sha512 = ? WHERE id = ?;");
-				query.bind(1, hashes["md5"]);
-				query.bind(2, hashes["sha256"]);
-				query.bind(3, hashes["sha512"]);
-				query.bind(4, context->buildId);
+					reject(res, *exchange, "503 Service Unavailable", "Database Busy", 1);
+
+					return;
+				}
 
-				database.get().exec(query.getExpandedSQL());
+				write.end();
 
 				auto json = json::object();
 
@@ -309,171 +541,103 @@ int main(int argc, char *argv[]) {
 				json["sha256"] = hashes["sha256"];
 				json["sha512"] = hashes["sha512"];
 
-				res->cork([res, &json]() {
-					res->writeHeader("Content-Type", "application/json");
-					res->end(json.dump());
-				});
-			}
-		});
-	});
+				respond(res, *exchange, "200 OK", serialize(json));
 
-	app.get("/v2", [&database](auto *res, auto *req) {
-		SQLite::Statement query(database.get(), "SELECT name FROM projects");
-		auto json = json::object();
+				Span publish("publish");
 
-		json["projects"] = json::array();
+				SQLite::Statement query(database.get(), "SELECT projects.name AS project, versions.name AS version, builds.build, builds.result FROM builds INNER JOIN versions ON versions.id = builds.version_id INNER JOIN projects ON projects.id = versions.project_id WHERE builds.id = ?;");
+				query.bind(1, context->buildId);
 
-		for (auto row : database.query(query)) {
-			json["projects"].push_back(row["name"]);
-		}
+				auto results = database.query(query);
 
-		res->cork([res, &json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->end(json.dump());
-		});
-	});
+				if (results.size()) {
+					auto row = results.front();
+					auto event = json::object();
 
-	app.get("/v2/:project", [&database](auto *res, auto *req) {
-		std::string project = std::string(req->getParameter(0)).data();
+					event["event"] = "build";
+					event["project"] = row["project"];
+					event["version"] = row["version"];
+					event["build"] = row["build"];
+					event["result"] = row["result"];
+					event["md5"] = hashes["md5"];
+					event["sha256"] = hashes["sha256"];
 
-		SQLite::Statement query(database.get(), "SELECT name FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?)");
-		query.bind(1, project);
+					auto message = event.dump();
 
-		auto json = json::object();
+					app.publish(row["project"], message, uWS::OpCode::TEXT);
+					app.publish(row["project"] + "/" + row["version"], message, uWS::OpCode::TEXT);
 
-		json["project"] = project;
-		json["versions"] = json::array();
+					if (exporter) {
+						exporter->version(row["project"], row["version"]);
+					}
+				}
+			}
+		});
+	}, Admission::Class::UPLOAD));
 
-		for (auto row : database.query(query)) {
-			json["versions"].push_back(row["name"]);
-		}
+	app.get("/v2", instrument(metrics, admission, "GET /v2", [&database](auto *res, auto *req, auto exchange) {
+		auto json = Responses::projects(database);
 
-		res->cork([res, &json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->end(json.dump());
-		});
-	});
+		respond(res, *exchange, "200 OK", serialize(json));
+	}));
 
-	app.get("/v2/:project/:version", [&database](auto *res, auto *req) {
+	app.get("/v2/:project", instrument(metrics, admission, "GET /v2/:project", [&database](auto *res, auto *req, auto exchange) {
 		std::string project = std::string(req->getParameter(0)).data();
-		std::string version = std::string(req->getParameter(1)).data();
 
-		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND ready = 1 ORDER BY id ASC");
-		query.bind(1, project);
-		query.bind(2, version);
+		auto json = Responses::versions(database, project);
 
-		auto json = json::object();
+		respond(res, *exchange, "200 OK", serialize(json));
+	}));
 
-		json["project"] = project;
-		json["version"] = version;
+	app.get("/v2/:project/commit/:hash", instrument(metrics, admission, "GET /v2/:project/commit/:hash", [&database](auto *res, auto *req, auto exchange) {
+		std::string project = std::string(req->getParameter(0)).data();
+		std::string hash = std::string(req->getParameter(1)).data();
 
-		json["builds"] = json::object();
-		json["builds"]["latest"] = json::object();
-		json["builds"]["all"] = json::array();
+		auto json = Responses::commit(database, project, hash);
 
-		auto results = database.query(query);
-
-		if (!results.size()) {
-			res->cork([res]() {
-				res->writeStatus("404 Not Found");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Version Not Found\"}");
-			});
+		if (!json) {
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Commit Not Found\"}");
 
 			return;
 		}
 
-		auto latest = results.back();
-
-		json["builds"]["latest"]["project"] = project;
-		json["builds"]["latest"]["version"] = version;
-		json["builds"]["latest"]["build"] = latest["build"];
-		json["builds"]["latest"]["result"] = latest["result"];
-		json["builds"]["latest"]["timestamp"] = std::stol(latest["timestamp"]);
-		json["builds"]["latest"]["duration"] = std::stoi(latest["duration"]);
-		json["builds"]["latest"]["md5"] = latest["md5"];
-		json["builds"]["latest"]["sha256"] = latest["sha256"];
-		json["builds"]["latest"]["sha512"] = latest["sha512"];
-		json["builds"]["latest"]["commits"] = json::parse(latest["commits"]);
-		json["builds"]["latest"]["metadata"] = json::parse(latest["metadata"]);
-
-		for (auto row : results) {
-			auto build = json::object();
-
-			build["project"] = project;
-			build["version"] = version;
-			build["build"] = row["build"];
-			build["result"] = row["result"];
-			build["timestamp"] = std::stol(row["timestamp"]);
-			build["duration"] = std::stoi(row["duration"]);
-			build["md5"] = row["md5"];
-			build["sha256"] = row["sha256"];
-			build["sha512"] = row["sha512"];
-			build["commits"] = json::parse(row["commits"]);
-			build["metadata"] = json::parse(row["metadata"]);
-
-			json["builds"]["all"].push_back(build);
-		}
+		respond(res, *exchange, "200 OK", serialize(*json));
+	}));
 
-		res->cork([res, &json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->end(json.dump());
-		});
-	});
-
-	app.get("/v2/:project/:version/:build", [&database](auto *res, auto *req) {
+	app.get("/v2/:project/:version", instrument(metrics, admission, "GET /v2/:project/:version", [&database](auto *res, auto *req, auto exchange) {
 		std::string project = std::string(req->getParameter(0)).data();
 		std::string version = std::string(req->getParameter(1)).data();
-		std::string build = std::string(req->getParameter(2)).data();
 
-		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND (build = ? OR ? = 'latest') AND ready = 1 ORDER BY id DESC LIMIT 1");
-		query.bind(1, project);
-		query.bind(2, version);
-		query.bind(3, build);
-		query.bind(4, build);
+		auto json = Responses::builds(database, project, version);
 
-		auto json = json::object();
+		if (!json) {
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Version Not Found\"}");
 
-		json["project"] = project;
-		json["version"] = version;
+			return;
+		}
 
-		auto results = database.query(query);
+		respond(res, *exchange, "200 OK", serialize(*json));
+	}));
 
-		if (!results.size()) {
-			res->cork([res]() {
-				res->writeStatus("404 Not Found");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Build Not Found\"}");
-			});
+	app.get("/v2/:project/:version/:build", instrument(metrics, admission, "GET /v2/:project/:version/:build", [&database](auto *res, auto *req, auto exchange) {
+		std::string project = std::string(req->getParameter(0)).data();
+		std::string version = std::string(req->getParameter(1)).data();
+		std::string build = std::string(req->getParameter(2)).data();
+
+		auto json = Responses::build(database, project, version, build);
+
+		if (!json) {
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Build Not Found\"}");
 
 			return;
 		}
 
-		auto row = results.front();
-
-		json["build"] = row["build"];
-		json["result"] = row["result"];
-		json["timestamp"] = std::stol(row["timestamp"]);
-		json["duration"] = std::stoi(row["duration"]);
-		json["md5"] = row["md5"];
-		json["sha256"] = row["sha256"];
-		json["sha512"] = row["sha512"];
-		json["commits"] = json::parse(row["commits"]);
-		json["metadata"] = json::parse(row["metadata"]);
-
-		res->cork([res, &json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->end(json.dump());
-		});
-	});
+		respond(res, *exchange, "200 OK", serialize(*json));
+	}));
 
-	app.put("/v2/:project/:version/:build/metadata", [&database, key](auto *res, auto *req) {
+	app.put("/v2/:project/:version/:build/metadata", instrument(metrics, admission, "PUT /v2/:project/:version/:build/metadata", [&database, &exporter, key](auto *res, auto *req, auto exchange) {
 		if (req->getHeader("authorization") != key) {
-			res->cork([res]() {
-				res->writeStatus("401 Unauthorized");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Unauthorized\"}");
-			});
+			respond(res, *exchange, "401 Unauthorized", "{\"error\": \"Unauthorized\"}");
 
 			return;
 		}
@@ -482,6 +646,8 @@ int main(int argc, char *argv[]) {
 		std::string version = std::string(req->getParameter(1)).data();
 		std::string build = std::string(req->getParameter(2)).data();
 
+		Span resolve("db.resolve");
+
 		SQLite::Statement query(database.get(), "SELECT id FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND build = ? AND ready = 1 ORDER BY id DESC LIMIT 1");
 		query.bind(1, project);
 		query.bind(2, version);
@@ -490,17 +656,15 @@ int main(int argc, char *argv[]) {
 		auto results = database.query(query);
 
 		if (!results.size()) {
-			res->cork([res]() {
-				res->writeStatus("404 Not Found");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Build Not Found\"}");
-			});
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Build Not Found\"}");
 
 			return;
 		}
 
 		auto buildId = results.front()["id"];
 
+		resolve.end();
+
 		struct RequestContext {
 			std::shared_ptr<std::string> body;
 			bool closed;
@@ -510,44 +674,54 @@ int main(int argc, char *argv[]) {
 
 		std::shared_ptr<RequestContext> context = std::make_shared<RequestContext>();
 
-		res->onAborted([context]() {
+		res->onAborted([context, exchange]() {
 			context->closed = true;
+			exchange->abort();
 		});
 
-		res->onData([&database, res, context, buildId](std::string_view chunk, bool last) {
+		res->onData([&database, &exporter, res, context, exchange, buildId, project, version](std::string_view chunk, bool last) {
+			Tracer::request(exchange->id());
+
+			exchange->received(chunk.size());
 			context->body->append(std::string(chunk));
 
 			if (last) {
 				try {
 					auto metadata = json::parse(std::string(context->body->c_str()));
 
+					Span write("db.write");
+
 					SQLite::Statement query(database.get(), "UPDATE builds SET metadata = ? WHERE id = ?;");
 					query.bind(1, metadata.dump());
 					query.bind(2, buildId);
 
-					database.get().exec(query.getExpandedSQL());
+					database.exec(query);
+					write.end();
+
+					if (exporter) {
+						exporter->version(project, version);
+					}
 
-					res->cork([res]() {
-						res->writeHeader("Content-Type", "application/json");
-						res->end("{\"success\": true}");
-					});
+					respond(res, *exchange, "200 OK", "{\"success\": true}");
 				} catch (json::parse_error &e) {
-					res->cork([res]() {
-						res->writeStatus("400 Bad Request");
-						res->writeHeader("Content-Type", "application/json");
-						res->end("{\"error\": \"Invalid JSON\"}");
-					});
+					respond(res, *exchange, "400 Bad Request", "{\"error\": \"Invalid JSON\"}");
+				} catch (SQLite::Exception &e) {
+					// the reconciler held the write lock for longer than the busy timeout
+					reject(res, *exchange, "503 Service Unavailable", "Database Busy", 1);
 				}
 			}
 		});
-	});
+	}));
 
-	app.get("/v2/:project/:version/:build/download", [&database, &storage](auto *res, auto *req) {
+	app.get("/v2/:project/:version/:build/download", instrument(metrics, admission, "GET /v2/:project/:version/:build/download", [&database, &storage](auto *res, auto *req, auto exchange) {
 		std::string project = std::string(req->getParameter(0)).data();
 		std::string version = std::string(req->getParameter(1)).data();
 		std::string build = std::string(req->getParameter(2)).data();
 
-		SQLite::Statement query(database.get(), "SELECT file_extension, md5, build FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND (build = ? OR ? = 'latest') AND ready = 1 ORDER BY id DESC LIMIT 1");
+		Span resolve("db.resolve");
+
+		// builds uploaded before artifacts were tracked have no row and are stored as is
+		SQLite::Statement query(database.get(), "SELECT builds.file_extension, builds.md5, builds.build, artifacts.size, artifacts.encoding FROM builds LEFT JOIN artifacts ON artifacts.md5 = builds.md5 WHERE builds.version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND (builds.build = ? OR ? = 'latest') AND builds.ready = 1 ORDER BY builds.id DESC LIMIT 1");
 		query.bind(1, project);
 		query.bind(2, version);
 		query.bind(3, build);
@@ -556,87 +730,195 @@ int main(int argc, char *argv[]) {
 		auto results = database.query(query);
 
 		if (!results.size()) {
-			res->cork([res]() {
-				res->writeStatus("404 Not Found");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Build Not Found\"}");
-			});
+			respond(res, *exchange, "404 Not Found", "{\"error\": \"Build Not Found\"}");
 
 			return;
 		}
 
 		auto row = results.front();
 
-		auto size = storage.size(row["md5"]);
-		auto stream = storage.retrieve(row["md5"]);
+		resolve.end();
+		Span opening("storage.open");
 
-		if (!stream.is_open()) {
-			res->cork([res]() {
-				res->writeStatus("500 Internal Server Error");
-				res->writeHeader("Content-Type", "application/json");
-				res->end("{\"error\": \"Failed to Retrieve Build\"}");
-			});
+		bool gzipped = row["encoding"] == "gzip";
+		bool passthrough = gzipped && acceptsGzip(req->getHeader("accept-encoding"));
+
+		// the blob can be missing from storage (the reconciler reports those), that mustn't throw
+		std::error_code error;
+		auto size = gzipped && !passthrough ? std::stoull(row["size"]) : storage.size(row["md5"] + (gzipped ? ".gz" : ""), error);
+		auto reader = storage.retrieve(row["md5"], gzipped ? "gzip" : "identity", !passthrough);
+
+		opening.end();
+
+		if (error || !reader.is_open()) {
+			respond(res, *exchange, "500 Internal Server Error", "{\"error\": \"Failed to Retrieve Build\"}");
 
 			return;
 		}
 
-		res->onAborted([&stream]() {
-			stream.close();
+		auto download = std::make_shared<Download>();
+
+		download->reader = std::move(reader);
+		download->size = size;
+		download->exchange = exchange;
+		download->reads = &exchange->metrics().storage("read");
+
+		res->onAborted([download]() {
+			download->reader.close();
+			download->exchange->abort();
+		});
+
+		res->onWritable([res, download](uintmax_t offset) {
+			return pump(res, download);
 		});
 
-		res->cork([res, &stream, project, version, build, &row, size]() {
+		res->cork([res, project, version, &row, gzipped, passthrough]() {
 			res->writeHeader("Content-Type", "application/octet-stream");
-			res->writeHeader("Content-Length", std::to_string(size));
+
+			if (passthrough) {
+				res->writeHeader("Content-Encoding", "gzip");
+			}
+
+			if (gzipped) {
+				res->writeHeader("Vary", "Accept-Encoding");
+			}
+
 			res->writeHeader("Content-Disposition", "attachment; filename=\"" + project + "-" + version + "-" + row["build"] + "." + row["file_extension"] + "\"");
 		});
 
-		char buffer[1024];
-		bool paused = false;
-		std::streampos lastPosition;
-
-		auto readAndProcess = [&]() -> bool {
-			if (paused) return false;
-
-			stream.read(buffer, sizeof(buffer));
-			std::streamsize bytesRead = stream.gcount();
-			
-			if (bytesRead == 0) return false;
-
-			auto lastOffset = res->getWriteOffset();
-			auto [ok, done] = res->tryEnd(std::string_view(buffer, bytesRead), size);
-
-			if (done) {
-				return false;
-			} else if (!ok) {
-				paused = true;
-				lastPosition = stream.tellg();
-				res->onWritable([&](int offset) {
-					char* sliced = buffer + (offset - lastOffset);
-					std::streamsize remainingBytes = bytesRead - (offset - lastOffset);
-
-					auto [ok, done] = res->tryEnd(std::string_view(sliced, remainingBytes), size);
-					
-					if (done) {
-						return false;
-					}
+		pump(res, download);
+	}, Admission::Class::DOWNLOAD));
 
-					if (ok) {
-						paused = false;
-						stream.seekg(lastPosition);
-					}
+	app.get("/metrics", [&metrics](auto *res, auto *req) {
+		auto body = metrics.render();
 
-					return ok;
-				});
-			}
+		res->cork([res, &body]() {
+			res->writeHeader("Content-Type", "text/plain; version=0.0.4");
+			res->end(body);
+		});
+	});
 
-			return true;
-		};
+	// Chrome trace of the most recent spans, open it in chrome://tracing or ui.perfetto.dev
+	app.get("/trace", [key](auto *res, auto *req) {
+		if (req->getHeader("authorization") != key) {
+			res->writeStatus("401 Unauthorized");
+			res->writeHeader("Content-Type", "application/json");
+			res->end("{\"error\": \"Unauthorized\"}");
+
+			return;
+		}
 
-		while (readAndProcess()) {}
+		auto body = Tracer::get().chrome();
 
-		stream.close();
+		res->cork([res, &body]() {
+			res->writeHeader("Content-Type", "application/json");
+			res->end(body);
+		});
+	});
+
+	// topics a single socket may subscribe to
+	constexpr size_t maxTopics = 16;
+
+	struct Subscriber {
+		std::set<std::string> topics;
+	};
+
+	// clients send {"subscribe": "<project>"} or {"subscribe": "<project>/<version>"}
+	// and receive an event whenever a build of that topic becomes ready
+	uWS::App::WebSocketBehavior<Subscriber> subscriptions;
+
+	subscriptions.compression = uWS::DISABLED;
+	subscriptions.maxPayloadLength = 1024;
+	subscriptions.idleTimeout = 120;
+
+	// the exchange ends with the handshake, open sockets are counted by open/close instead
+	subscriptions.upgrade = instrument(metrics, admission, "GET /v2/subscribe", [&admission](auto *res, auto *req, auto exchange, auto *context) {
+		if (admission.saturated(Admission::Class::SUBSCRIBE)) {
+			reject(res, *exchange, "503 Service Unavailable", "Server Busy", 1);
+
+			return;
+		}
+
+		res->template upgrade<Subscriber>(Subscriber {}, req->getHeader("sec-websocket-key"), req->getHeader("sec-websocket-protocol"), req->getHeader("sec-websocket-extensions"), context);
+
+		exchange->finish(101, 0);
 	});
 
+	subscriptions.open = [&metrics](auto *ws) {
+		metrics.subscribers.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	subscriptions.close = [&metrics](auto *ws, int code, std::string_view message) {
+		metrics.subscribers.fetch_sub(1, std::memory_order_relaxed);
+	};
+
+	subscriptions.message = [&database](auto *ws, std::string_view message, uWS::OpCode opCode) {
+		json data = json::parse(message, nullptr, false);
+
+		if (data.is_discarded() || !data.is_object()) {
+			ws->send("{\"error\": \"Invalid JSON\"}", uWS::OpCode::TEXT);
+			return;
+		}
+
+		auto reply = json::object();
+
+		for (std::string action : { "subscribe", "unsubscribe" }) {
+			auto it = data.find(action);
+			if (it == data.end()) {
+				continue;
+			}
+
+			std::string topic = it->is_string() ? it->get_ref<const std::string &>() : "";
+
+			if (topic.empty() || topic.size() > 256) {
+				ws->send("{\"error\": \"Invalid Topic\"}", uWS::OpCode::TEXT);
+				return;
+			}
+
+			auto &topics = ws->getUserData()->topics;
+
+			if (action == "subscribe" && !topics.count(topic)) {
+				if (topics.size() >= maxTopics) {
+					ws->send("{\"error\": \"Too Many Topics\"}", uWS::OpCode::TEXT);
+					return;
+				}
+
+				auto slash = topic.find('/');
+				SQLite::Statement query(database.get(), "SELECT id FROM projects WHERE name = ?;");
+
+				if (slash == std::string::npos) {
+					query.bind(1, topic);
+				} else {
+					query = SQLite::Statement(database.get(), "SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?;");
+					query.bind(1, topic.substr(0, slash));
+					query.bind(2, topic.substr(slash + 1));
+				}
+
+				if (database.query(query).empty()) {
+					ws->send("{\"error\": \"Unknown Topic\"}", uWS::OpCode::TEXT);
+					return;
+				}
+
+				topics.insert(topic);
+				ws->subscribe(topic);
+			} else if (action == "unsubscribe") {
+				topics.erase(topic);
+				ws->unsubscribe(topic);
+			}
+
+			reply[action + "d"] = topic;
+		}
+
+		if (reply.empty()) {
+			ws->send("{\"error\": \"Unknown Action\"}", uWS::OpCode::TEXT);
+			return;
+		}
+
+		ws->send(reply.dump(), uWS::OpCode::TEXT);
+	};
+
+	app.ws<Subscriber>("/v2/subscribe", std::move(subscriptions));
+
 	app.run();
 
 	return 0;
@@ -0,0 +1,119 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+
+#include <utils/metrics.cpp>
+
+#ifndef ADMISSION_CPP
+#define ADMISSION_CPP
+
+// Decides whether a request may start, before any DB or storage work is done
+// for it. Only used from the event loop thread, so nothing here is locked.
+class Admission {
+public:
+	// routes whose requests stay in flight across loop iterations, subscribers for as long as their socket is open
+	enum class Class {
+		UPLOAD,
+		DOWNLOAD,
+		SUBSCRIBE
+	};
+private:
+	struct Bucket {
+		double tokens;
+		std::chrono::steady_clock::time_point updated;
+	};
+
+	Metrics &_metrics;
+	int64_t _limits[3] = {};
+
+	double _rate = 0;
+	double _burst = 0;
+	size_t _prune = 4096;
+	std::unordered_map<std::string, Bucket> _buckets;
+
+	// Tops the bucket up for the time since it was last used
+	void refill(Bucket &bucket, std::chrono::steady_clock::time_point now) {
+		double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+
+		bucket.tokens = std::min(_burst, bucket.tokens + elapsed * _rate);
+		bucket.updated = now;
+	}
+
+	// Forgets clients whose bucket filled up again, they start out full anyway
+	void prune(std::chrono::steady_clock::time_point now) {
+		for (auto it = _buckets.begin(); it != _buckets.end();) {
+			refill(it->second, now);
+
+			if (it->second.tokens >= _burst) {
+				it = _buckets.erase(it);
+			} else {
+				it++;
+			}
+		}
+
+		_prune = std::max<size_t>(4096, _buckets.size() * 2);
+	}
+public:
+	Admission(Metrics &metrics) : _metrics(metrics) {}
+
+	// At most max requests of the class in flight, 0 for no limit
+	void limit(Class type, int64_t max) {
+		_limits[(int)type] = max;
+	}
+
+	// Every client may make rate requests per second with bursts of up to burst, 0 turns it off
+	void rate(double rate, double burst) {
+		_rate = rate;
+		_burst = std::max(1.0, burst);
+	}
+
+	std::atomic<int64_t> &inFlight(Class type) {
+		return type == Class::UPLOAD ? _metrics.uploads : type == Class::DOWNLOAD ? _metrics.downloads : _metrics.subscribers;
+	}
+
+	// Seconds the client has to wait before its next request is admitted, 0 if it can go ahead
+	int throttle(const std::string &client) {
+		if (_rate <= 0) {
+			return 0;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+
+		if (_buckets.size() >= _prune) {
+			prune(now);
+		}
+
+		auto [it, created] = _buckets.try_emplace(client, Bucket { _burst, now });
+		auto &bucket = it->second;
+
+		if (!created) {
+			refill(bucket, now);
+		}
+
+		if (bucket.tokens >= 1) {
+			bucket.tokens -= 1;
+			return 0;
+		}
+
+		_metrics.throttled.fetch_add(1, std::memory_order_relaxed);
+
+		return std::max(1, (int)std::ceil((1 - bucket.tokens) / _rate));
+	}
+
+	// Whether the class is at its limit, a request that is shed should be retried after a second
+	bool saturated(Class type) {
+		auto max = _limits[(int)type];
+
+		if (!max || inFlight(type).load(std::memory_order_relaxed) < max) {
+			return false;
+		}
+
+		_metrics.shed.fetch_add(1, std::memory_order_relaxed);
+
+		return true;
+	}
+};
+
+#endif // ADMISSION_CPP
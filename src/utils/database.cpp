@@ -1,6 +1,4 @@
-#include <string>
-#include <vector>
-#include <SQLiteCpp/SQLiteCpp.h>
+#include <utils/database.h>
 
 std::string migrations() {
 	return R"(
@@ -34,38 +32,85 @@ CREATE TABLE IF NOT EXISTS `versions` (
 CREATE UNIQUE INDEX IF NOT EXISTS `projects_name_unique` ON `projects` (`name`);
 --> statement-breakpoint
 CREATE UNIQUE INDEX IF NOT EXISTS `versions_project_id_name_unique` ON `versions` (`project_id`, `name`);
+--> statement-breakpoint
+CREATE TABLE IF NOT EXISTS `commits` (
+	`id` integer PRIMARY KEY NOT NULL,
+	`build_id` integer NOT NULL,
+	`author` text NOT NULL,
+	`email` text NOT NULL,
+	`description` text NOT NULL,
+	`hash` text NOT NULL,
+	`timestamp` integer NOT NULL,
+	`raw` text
+);
+--> statement-breakpoint
+CREATE INDEX IF NOT EXISTS `commits_hash_idx` ON `commits` (`hash`);
+--> statement-breakpoint
+CREATE INDEX IF NOT EXISTS `commits_build_id_idx` ON `commits` (`build_id`);
+--> statement-breakpoint
+UPDATE `commits` SET `timestamp` = 0 WHERE typeof(`timestamp`) != 'integer';
+--> statement-breakpoint
+CREATE TABLE IF NOT EXISTS `artifacts` (
+	`md5` text(32) PRIMARY KEY NOT NULL,
+	`size` integer NOT NULL,
+	`encoding` text NOT NULL,
+	`stored_size` integer NOT NULL
+);
+--> statement-breakpoint
+CREATE TABLE IF NOT EXISTS `reconciliation` (
+	`name` text PRIMARY KEY NOT NULL,
+	`value` integer NOT NULL
+);
 	)";
 };
 
+// ADD COLUMN fails when the column exists, so those migrations have to check first
+static bool hasColumn(SQLite::Database &database, const std::string &table, const std::string &column) {
+	SQLite::Statement query(database, "SELECT 1 FROM pragma_table_info(?) WHERE name = ?;");
+	query.bind(1, table);
+	query.bind(2, column);
+
+	return query.executeStep();
+}
+
 void migrate(SQLite::Database &database) {
+	// readers never wait for a writer (or the other way around), only writers for each other.
+	// Persists in the database file and can't be changed inside a transaction
+	database.exec("PRAGMA journal_mode = WAL;");
+
 	SQLite::Transaction transaction(database);
 
 	database.exec(migrations());
 
-	transaction.commit();
-}
-
-class DB {
-private:
-	SQLite::Database _database;
-public:
-	DB(const std::string path) : _database(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {}
-
-	SQLite::Database &get() {
-		return this->_database;
+	// commits copied before the submitted objects were kept are copied again, builds.commits still has them
+	if (!hasColumn(database, "commits", "raw")) {
+		database.exec("ALTER TABLE `commits` ADD COLUMN `raw` text;");
+		database.exec("DELETE FROM `commits` WHERE `build_id` IN (SELECT `id` FROM `builds` WHERE `commits` != '[]');");
 	}
 
-	std::vector<std::map<std::string, std::string>> query(SQLite::Statement &statement) {
-		std::vector<std::map<std::string, std::string>> result;
+	// the columns are only for lookups, responses return raw as it was submitted
+	database.exec(R"(
+INSERT INTO `commits` (`build_id`, `author`, `email`, `description`, `hash`, `timestamp`, `raw`)
+	SELECT `builds`.`id`, COALESCE(json_extract(`value`, '$.author'), ''), COALESCE(json_extract(`value`, '$.email'), ''), COALESCE(json_extract(`value`, '$.description'), ''), COALESCE(json_extract(`value`, '$.hash'), ''), CASE json_type(`value`, '$.timestamp') WHEN 'integer' THEN json_extract(`value`, '$.timestamp') ELSE 0 END, json(`value`)
+	FROM `builds`, json_each(`builds`.`commits`)
+	WHERE `builds`.`commits` != '[]' AND NOT EXISTS (SELECT 1 FROM `commits` WHERE `commits`.`build_id` = `builds`.`id`)
+	ORDER BY `builds`.`id` ASC, json_each.`key` ASC;
+	)");
+
+	// when the server created the build, builds.timestamp is whatever the client sent
+	if (!hasColumn(database, "builds", "created")) {
+		database.exec("ALTER TABLE `builds` ADD COLUMN `created` integer NOT NULL DEFAULT 0;");
 
-		while (statement.executeStep()) {
-			std::map<std::string, std::string> row;
-			for (int i = 0; i < statement.getColumnCount(); i++) {
-				row[statement.getColumnName(i)] = statement.getColumn(i).getText();
-			}
-			result.push_back(row);
-		}
+		// existing builds get a full grace period before the reconciler may remove them
+		SQLite::Statement query(database, "UPDATE `builds` SET `created` = ?;");
+		query.bind(1, (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		query.exec();
+	}
 
-		return result;
+	// NULL for artifacts that may have been hashed before Storage::hashVersion 1, the reconciler sets it once verified
+	if (!hasColumn(database, "artifacts", "hash_version")) {
+		database.exec("ALTER TABLE `artifacts` ADD COLUMN `hash_version` integer;");
 	}
-};
\ No newline at end of file
+
+	transaction.commit();
+}
@@ -1,3 +1,6 @@
+#include <chrono>
+#include <functional>
+#include <map>
 #include <string>
 #include <vector>
 #include <SQLiteCpp/SQLiteCpp.h>
@@ -12,15 +15,32 @@ void migrate(SQLite::Database &database);
 class DB {
 private:
 	SQLite::Database _database;
+	std::function<void(const std::string &, std::chrono::nanoseconds)> _observer;
+
+	void observed(SQLite::Statement &statement, std::chrono::steady_clock::time_point start) {
+		if (this->_observer) {
+			this->_observer(statement.getQuery(), std::chrono::steady_clock::now() - start);
+		}
+	}
 public:
-	DB(const std::string path) : _database(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {}
+	// busyTimeout is how long a write waits for another connection's write to finish, keep it
+	// short on the event loop, background threads can afford to wait for it
+	DB(const std::string path, int busyTimeout = 250) : _database(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
+		this->_database.setBusyTimeout(busyTimeout);
+	}
 
 	SQLite::Database &get() {
 		return this->_database;
 	}
 
+	// Gets called with the (unexpanded) sql and duration of every statement run through query() or exec()
+	void observe(std::function<void(const std::string &, std::chrono::nanoseconds)> observer) {
+		this->_observer = observer;
+	}
+
 	std::vector<std::map<std::string, std::string>> query(SQLite::Statement &statement) {
 		std::vector<std::map<std::string, std::string>> result;
+		auto start = std::chrono::steady_clock::now();
 
 		while (statement.executeStep()) {
 			std::map<std::string, std::string> row;
@@ -30,8 +50,20 @@ public:
 			result.push_back(row);
 		}
 
+		this->observed(statement, start);
+
 		return result;
 	}
+
+	int exec(SQLite::Statement &statement) {
+		auto start = std::chrono::steady_clock::now();
+
+		int changes = statement.exec();
+
+		this->observed(statement, start);
+
+		return changes;
+	}
 };
 
 #endif // DATABASE_H
\ No newline at end of file
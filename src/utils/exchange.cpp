@@ -0,0 +1,179 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+#include <utils/admission.cpp>
+#include <utils/logger.cpp>
+#include <utils/metrics.cpp>
+#include <utils/trace.cpp>
+
+#ifndef EXCHANGE_CPP
+#define EXCHANGE_CPP
+
+// One request/response pair, finished exactly once when the response is
+// ended or the client goes away
+class Exchange {
+private:
+	Metrics &_metrics;
+	Metrics::Route &_route;
+	std::string _name;
+	std::string _url;
+	std::string _client;
+	std::chrono::steady_clock::time_point _start;
+	uint64_t _id;
+	int64_t _traceStart;
+	std::atomic<int64_t> *_gauge = nullptr;
+	bool _finished = false;
+public:
+	Exchange(Metrics &metrics, Metrics::Route &route, const std::string &name, std::string_view url, std::string_view client) : _metrics(metrics), _route(route), _name(name), _url(url), _client(client), _start(std::chrono::steady_clock::now()), _traceStart(Tracer::get().now()) {
+		static std::atomic<uint64_t> ids{0};
+
+		_id = ids.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+
+	uint64_t id() const {
+		return _id;
+	}
+
+	Metrics &metrics() {
+		return _metrics;
+	}
+
+	const std::string &client() const {
+		return _client;
+	}
+
+	bool finished() const {
+		return _finished;
+	}
+
+	// Counts this exchange in a gauge (active uploads, downloads) until it finishes
+	void track(std::atomic<int64_t> &gauge) {
+		_gauge = &gauge;
+		_gauge->fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void received(size_t bytes) {
+		_metrics.bytesIn.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void finish(int status, size_t bytes) {
+		if (_finished) {
+			return;
+		}
+
+		_finished = true;
+
+		auto duration = std::chrono::steady_clock::now() - _start;
+
+		_route.latency.observe(duration);
+
+		if (Tracer::get().enabled()) {
+			Tracer::get().record(_route.name.c_str(), _id, _traceStart, Tracer::get().now());
+		}
+
+		_route.responses[status >= 100 && status < 600 ? status / 100 : 0].fetch_add(1, std::memory_order_relaxed);
+		_metrics.bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+
+		if (_gauge) {
+			_gauge->fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		auto level = status >= 500 ? Level::ERROR : status >= 400 || !status ? Level::WARN : Level::INFO;
+
+		if (Logger::sink().accessEnabled() && Logger::sink().enabled(level)) {
+			auto line = nlohmann::json::object();
+
+			line["time"] = LogSink::now();
+			line["level"] = level == Level::ERROR ? "error" : level == Level::WARN ? "warn" : "info";
+			line["route"] = _name;
+			line["path"] = _url;
+			line["status"] = status;
+			line["aborted"] = !status;
+			line["bytes"] = bytes;
+			line["duration_us"] = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+			line["client"] = _client;
+
+			Logger::access(line.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
+		}
+	}
+
+	// The client went away before the response was complete
+	void abort() {
+		finish(0, 0);
+	}
+};
+
+template <typename Response>
+void reject(Response *res, Exchange &exchange, const std::string &status, const std::string &error, int retryAfter) {
+	std::string body = "{\"error\": \"" + error + "\"}";
+
+	res->cork([res, &status, &body, retryAfter]() {
+		res->writeStatus(status);
+		res->writeHeader("Retry-After", std::to_string(retryAfter));
+		res->writeHeader("Content-Type", "application/json");
+		res->end(body);
+	});
+
+	exchange.finish(std::stoi(status), body.size());
+}
+
+// Wraps a route handler so every request gets its own exchange and is
+// rate limited, with type the request also counts against its class' limit.
+// Arguments after the request (the socket context of an upgrade) are passed on.
+// The root span starts here, uWS has matched the route by then, so route
+// matching is the (untimed) gap before it rather than a span of its own
+template <typename Handler>
+auto instrument(Metrics &metrics, Admission &admission, const std::string &name, Handler handler, std::optional<Admission::Class> type = std::nullopt) {
+	auto &route = metrics.route(name);
+
+	return [&metrics, &admission, &route, name, handler, type](auto *res, auto *req, auto... rest) {
+		auto exchange = std::make_shared<Exchange>(metrics, route, name, req->getUrl(), res->getRemoteAddressAsText());
+
+		Tracer::request(exchange->id());
+
+		if (int retryAfter = admission.throttle(exchange->client())) {
+			reject(res, *exchange, "429 Too Many Requests", "Too Many Requests", retryAfter);
+
+			return;
+		}
+
+		if (type) {
+			if (admission.saturated(*type)) {
+				reject(res, *exchange, "503 Service Unavailable", "Server Busy", 1);
+
+				return;
+			}
+
+			exchange->track(admission.inFlight(*type));
+		}
+
+		handler(res, req, exchange, rest...);
+	};
+}
+
+// json::dump() timed as its own phase of the request
+inline std::string serialize(const nlohmann::json &json) {
+	Span span("json.serialize");
+
+	return json.dump();
+}
+
+template <typename Response>
+void respond(Response *res, Exchange &exchange, const std::string &status, const std::string &body, const std::string &contentType = "application/json") {
+	Span span("write");
+
+	res->cork([res, &status, &body, &contentType]() {
+		res->writeStatus(status);
+		res->writeHeader("Content-Type", contentType);
+		res->end(body);
+	});
+
+	exchange.finish(std::stoi(status), body.size());
+}
+
+#endif // EXCHANGE_CPP
@@ -0,0 +1,320 @@
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <nlohmann/json.hpp>
+#include <zlib.h>
+
+#include <utils/database.h>
+#include <utils/logger.cpp>
+#include <utils/responses.cpp>
+#include <utils/storage.cpp>
+
+#ifndef EXPORTER_CPP
+#define EXPORTER_CPP
+
+// Mirrors the read API into a directory a static file server can serve:
+// every response is written as <url>/index.json (plus a gzipped copy) and
+// artifacts are hard linked as <url>/download. Everything is exported once
+// at start, after that only the project/version a write touched.
+class Exporter {
+private:
+	using json = nlohmann::json;
+
+	DB _database;
+	Storage &_storage;
+	std::filesystem::path _directory;
+
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	// (project, version), an empty version refreshes the listings of the project, both empty everything
+	std::set<std::pair<std::string, std::string>> _jobs;
+	bool _stopping = false;
+
+	// Names that can't be used as a path segment as is, they are left out of the export
+	static bool safe(const std::string &name) {
+		return !name.empty() && name != "." && name != ".." && name.find_first_of(std::string("/\\\0", 3)) == std::string::npos;
+	}
+
+	static std::optional<std::string> gzip(const std::string &content) {
+		z_stream stream {};
+
+		if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return std::nullopt;
+		}
+
+		std::string compressed(deflateBound(&stream, content.size()), '\0');
+
+		stream.next_in = (Bytef *)content.data();
+		stream.avail_in = content.size();
+		stream.next_out = (Bytef *)compressed.data();
+		stream.avail_out = compressed.size();
+
+		int result = deflate(&stream, Z_FINISH);
+		compressed.resize(stream.total_out);
+		deflateEnd(&stream);
+
+		if (result != Z_STREAM_END) {
+			return std::nullopt;
+		}
+
+		return compressed;
+	}
+
+	// Replaces the file in one step so readers never see it half written
+	bool replace(const std::filesystem::path &path, const std::string &content) {
+		auto temporary = path;
+		temporary += ".tmp";
+
+		{
+			std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+			file << content;
+
+			if (!file) {
+				return false;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporary, path, error);
+
+		return !error;
+	}
+
+	void write(const std::filesystem::path &directory, const json &body) {
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+
+		auto path = directory / "index.json";
+		auto content = body.dump();
+
+		// unchanged files keep their mtime (and etag) so caches stay valid
+		std::ifstream existing(path, std::ios::binary);
+		if (existing.is_open()) {
+			std::ostringstream current;
+			current << existing.rdbuf();
+
+			if (current.str() == content) {
+				return;
+			}
+		}
+
+		if (!replace(path, content)) {
+			Logger::level(Level::ERROR).log("Failed to export " + path.string());
+			return;
+		}
+
+		auto compressed = directory / "index.json.gz";
+		auto gzipped = gzip(content);
+
+		// a stale copy would be served instead of the new index.json
+		if (!gzipped || !replace(compressed, *gzipped)) {
+			std::filesystem::remove(compressed, error);
+			Logger::level(Level::ERROR).log("Failed to export " + compressed.string());
+		}
+	}
+
+	// Links <directory>/download (or download.gz for artifacts gzipped at rest) to the stored artifact
+	void link(const std::filesystem::path &directory, const std::string &md5) {
+		std::error_code error;
+		std::filesystem::path artifact = _storage.get() + "/" + md5;
+		std::string name = "download";
+
+		if (!std::filesystem::exists(artifact, error)) {
+			artifact += ".gz";
+			name += ".gz";
+		}
+
+		if (!std::filesystem::exists(artifact, error)) {
+			return;
+		}
+
+		auto path = directory / name;
+		auto temporary = directory / (name + ".tmp");
+
+		if (std::filesystem::equivalent(artifact, path, error)) {
+			return;
+		}
+
+		std::filesystem::remove(temporary, error);
+		std::filesystem::create_hard_link(artifact, temporary, error);
+
+		// storage on another file system can't be hard linked
+		if (error) {
+			std::filesystem::create_symlink(std::filesystem::absolute(artifact), temporary, error);
+		}
+
+		std::filesystem::rename(temporary, path, error);
+
+		if (error) {
+			Logger::level(Level::ERROR).log("Failed to link " + path.string() + ": " + error.message());
+			return;
+		}
+
+		std::filesystem::remove(directory / (name == "download" ? "download.gz" : "download"), error);
+	}
+
+	void listings(const std::string &project) {
+		write(_directory / "v2", Responses::projects(_database));
+
+		if (safe(project)) {
+			write(_directory / "v2" / project, Responses::versions(_database, project));
+		}
+	}
+
+	void builds(const std::string &project, const std::string &version) {
+		if (!safe(project) || !safe(version) || version == "commit") {
+			return;
+		}
+
+		auto listing = Responses::builds(_database, project, version);
+
+		if (!listing) {
+			return;
+		}
+
+		auto directory = _directory / "v2" / project / version;
+		std::set<std::string> commits;
+
+		write(directory, *listing);
+
+		// the listing holds exactly what GET /v2/:project/:version/:build returns for each build
+		for (auto &build : (*listing)["builds"]["all"]) {
+			std::string name = build["build"];
+
+			if (safe(name) && name != "latest") {
+				write(directory / name, build);
+				link(directory / name, build["md5"]);
+			}
+
+			for (auto &commit : build["commits"]) {
+				commits.insert(commit["hash"].get<std::string>());
+			}
+		}
+
+		auto &latest = (*listing)["builds"]["latest"];
+
+		write(directory / "latest", latest);
+		link(directory / "latest", latest["md5"]);
+
+		for (auto &hash : commits) {
+			auto commit = Responses::commit(_database, project, hash);
+
+			if (commit && safe(hash)) {
+				write(_directory / "v2" / project / "commit" / hash, *commit);
+			}
+		}
+	}
+
+	void everything() {
+		auto start = std::chrono::steady_clock::now();
+		size_t versions = 0;
+
+		auto projects = Responses::projects(_database);
+
+		for (auto &project : projects["projects"]) {
+			listings(project);
+
+			auto listing = Responses::versions(_database, project);
+
+			for (auto &version : listing["versions"]) {
+				if (stopping()) {
+					return;
+				}
+
+				builds(project, version);
+				versions++;
+			}
+		}
+
+		Logger::level(Level::INFO).log("Exported " + std::to_string(versions) + " versions to " + _directory.string() + " in " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count()) + "s");
+	}
+
+	bool stopping() {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		return _stopping;
+	}
+
+	void run() {
+		while (true) {
+			std::pair<std::string, std::string> job;
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+
+				if (_stopping) {
+					return;
+				}
+
+				job = *_jobs.begin();
+				_jobs.erase(_jobs.begin());
+			}
+
+			try {
+				if (job.first.empty()) {
+					everything();
+				} else if (job.second.empty()) {
+					listings(job.first);
+				} else {
+					builds(job.first, job.second);
+				}
+			} catch (std::exception &e) {
+				Logger::level(Level::ERROR).log("Export failed: " + std::string(e.what()));
+			}
+		}
+	}
+
+	void enqueue(const std::string &project, const std::string &version) {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_jobs.emplace(project, version);
+		}
+
+		_wake.notify_one();
+	}
+public:
+	Exporter(const std::string &database, Storage &storage, const std::string &directory) : _database(database, 5000), _storage(storage), _directory(directory) {}
+
+	~Exporter() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+
+		_wake.notify_all();
+
+		if (_thread.joinable()) {
+			_thread.join();
+		}
+	}
+
+	// Exports everything, then waits for changes
+	void start() {
+		enqueue("", "");
+
+		_thread = std::thread([this]() { run(); });
+	}
+
+	// A version was added to the project
+	void project(const std::string &project) {
+		enqueue(project, "");
+	}
+
+	// A build of the version became ready or its metadata changed
+	void version(const std::string &project, const std::string &version) {
+		enqueue(project, version);
+	}
+};
+
+#endif // EXPORTER_CPP
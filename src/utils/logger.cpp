@@ -1,5 +1,17 @@
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unistd.h>
+
+#include <utils/ringbuffer.cpp>
+
+#ifndef LOGGER_CPP
+#define LOGGER_CPP
 
 enum class Color {
 	WHITE,
@@ -8,11 +20,113 @@ enum class Color {
 	BLUE
 };
 
-class Logger {
+enum class Level {
+	DEBUG,
+	INFO,
+	WARN,
+	ERROR
+};
+
+// Log output that rotates to <path>.1 ... <path>.<files> once it grows past maxSize bytes
+class LogFile {
 private:
-	Color _color = Color::WHITE;
+	std::string _path;
+	FILE *_file = nullptr;
+	bool _colors = false;
+	uintmax_t _maxSize = 0;
+	uintmax_t _size = 0;
+	int _files = 0;
+
+	void open() {
+		_file = fopen(_path.c_str(), "a");
+		_size = 0;
+
+		if (_file && fseek(_file, 0, SEEK_END) == 0) {
+			_size = ftell(_file);
+		}
+	}
+
+	void rotate() {
+		fclose(_file);
+
+		for (int i = _files - 1; i > 0; i--) {
+			std::rename((_path + "." + std::to_string(i)).c_str(), (_path + "." + std::to_string(i + 1)).c_str());
+		}
+
+		if (_files > 0) {
+			std::rename(_path.c_str(), (_path + ".1").c_str());
+		} else {
+			std::remove(_path.c_str());
+		}
+
+		open();
+	}
+public:
+	LogFile(FILE *file) : _file(file), _colors(isatty(fileno(file))) {}
+
+	LogFile(const std::string &path, uintmax_t maxSize, int files) : _path(path), _maxSize(maxSize), _files(files) {
+		open();
+	}
+
+	~LogFile() {
+		if (_file && !_path.empty()) {
+			fclose(_file);
+		}
+	}
+
+	bool colors() const {
+		return _colors;
+	}
+
+	void write(const std::string &line) {
+		if (!_file) {
+			return;
+		}
 
-	std::string format(const Color &color, const std::string &message) {
+		fwrite(line.data(), 1, line.size(), _file);
+		fputc('\n', _file);
+
+		_size += line.size() + 1;
+		if (_maxSize && !_path.empty() && _size >= _maxSize) {
+			rotate();
+		}
+	}
+
+	void flush() {
+		if (_file) {
+			fflush(_file);
+		}
+	}
+};
+
+// Records are formatted by the caller and handed to a background thread
+// through a lock-free ring buffer, so logging never blocks on a syscall
+class LogSink {
+public:
+	enum class Stream {
+		LOG,
+		ACCESS
+	};
+private:
+	struct Record {
+		Stream stream = Stream::LOG;
+		Color color = Color::WHITE;
+		std::string line;
+	};
+
+	RingBuffer<Record> _buffer{8192};
+	std::atomic<uint64_t> _dropped{0};
+	std::atomic<bool> _running{true};
+	std::atomic<Level> _level{Level::INFO};
+	std::atomic<bool> _access{false};
+
+	std::mutex _mutex;
+	std::unique_ptr<LogFile> _log = std::make_unique<LogFile>(stdout);
+	std::unique_ptr<LogFile> _accessLog;
+
+	std::thread _thread;
+
+	static std::string colorize(const Color &color, const std::string &message) {
 		std::string colorCode;
 		switch (color) {
 			case Color::WHITE:
@@ -30,17 +144,181 @@ private:
 		}
 		return colorCode + message + "\033[0m";
 	}
+
+	// Writes everything currently buffered, returns whether there was anything
+	bool drain() {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		Record record;
+		bool any = false;
+
+		while (_buffer.pop(record)) {
+			any = true;
+
+			if (record.stream == Stream::ACCESS) {
+				if (_accessLog) {
+					_accessLog->write(record.line);
+				}
+
+				continue;
+			}
+
+			_log->write(_log->colors() ? colorize(record.color, record.line) : record.line);
+		}
+
+		uint64_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped) {
+			_log->write(now() + " WARN dropped " + std::to_string(dropped) + " log records, buffer was full");
+		}
+
+		if (any || dropped) {
+			_log->flush();
+
+			if (_accessLog) {
+				_accessLog->flush();
+			}
+		}
+
+		return any;
+	}
+
+	void run() {
+		while (_running.load(std::memory_order_relaxed)) {
+			if (!drain()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+
+		drain();
+	}
 public:
-	static Logger color(Color color) {
+	LogSink() : _thread(&LogSink::run, this) {}
+
+	~LogSink() {
+		_running.store(false, std::memory_order_relaxed);
+		_thread.join();
+	}
+
+	// An empty path keeps writing to stdout (log) or disables the output (access log)
+	void configure(Level level, const std::string &log, const std::string &access, uintmax_t maxSize, int files) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_level.store(level, std::memory_order_relaxed);
+
+		if (!log.empty()) {
+			_log = std::make_unique<LogFile>(log, maxSize, files);
+		}
+
+		if (access == "stdout") {
+			_accessLog = std::make_unique<LogFile>(stdout);
+		} else if (!access.empty()) {
+			_accessLog = std::make_unique<LogFile>(access, maxSize, files);
+		}
+
+		_access.store(_accessLog != nullptr, std::memory_order_relaxed);
+	}
+
+	bool enabled(Level level) const {
+		return level >= _level.load(std::memory_order_relaxed);
+	}
+
+	bool accessEnabled() const {
+		return _access.load(std::memory_order_relaxed);
+	}
+
+	void push(Stream stream, Color color, std::string line) {
+		Record record;
+
+		record.stream = stream;
+		record.color = color;
+		record.line = std::move(line);
+
+		if (!_buffer.push(std::move(record))) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// UTC timestamp with millisecond precision
+	static std::string now() {
+		auto time = std::chrono::system_clock::now();
+		auto seconds = std::chrono::system_clock::to_time_t(time);
+		auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+		struct tm tm;
+		gmtime_r(&seconds, &tm);
+
+		char buffer[32];
+		size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(buffer + length, sizeof(buffer) - length, ".%03dZ", (int)millis);
+
+		return buffer;
+	}
+};
+
+class Logger {
+private:
+	Color _color = Color::WHITE;
+	Level _level = Level::INFO;
+
+	static std::string name(Level level) {
+		switch (level) {
+			case Level::DEBUG:
+				return "DEBUG";
+			case Level::INFO:
+				return "INFO";
+			case Level::WARN:
+				return "WARN";
+			case Level::ERROR:
+				return "ERROR";
+		}
+		return "";
+	}
+public:
+	static LogSink &sink() {
+		static LogSink sink;
+
+		return sink;
+	}
+
+	static Level parse(const std::string &level) {
+		if (level == "debug") return Level::DEBUG;
+		if (level == "warn") return Level::WARN;
+		if (level == "error") return Level::ERROR;
+
+		return Level::INFO;
+	}
+
+	static Logger color(Color color, Level level = Level::INFO) {
 		Logger logger;
 		logger._color = color;
+		logger._level = level;
 
 		return logger;
 	}
 
+	static Logger level(Level level) {
+		switch (level) {
+			case Level::ERROR:
+				return color(Color::RED, level);
+			case Level::WARN:
+				return color(Color::BLUE, level);
+			default:
+				return color(Color::WHITE, level);
+		}
+	}
+
 	Logger log(const std::string &message) {
-		std::cout << format(_color, message) << std::endl;
+		if (sink().enabled(_level)) {
+			sink().push(LogSink::Stream::LOG, _color, LogSink::now() + " " + name(_level) + " " + message);
+		}
 
 		return *this;
 	}
-};
\ No newline at end of file
+
+	// Structured access log line, callers check sink().accessEnabled() before formatting one
+	static void access(const std::string &line) {
+		sink().push(LogSink::Stream::ACCESS, Color::WHITE, line);
+	}
+};
+
+#endif // LOGGER_CPP
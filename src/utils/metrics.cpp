@@ -0,0 +1,222 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#ifndef METRICS_CPP
+#define METRICS_CPP
+
+// Latency histogram with HDR-style log-linear buckets, every power of two
+// between ~1µs and ~68s is split into 4 linear sub-buckets (<= 25% error)
+class Histogram {
+private:
+	static constexpr int SUB_BUCKETS = 4;
+	static constexpr int MIN_MAGNITUDE = 10;
+	static constexpr int MAX_MAGNITUDE = 36;
+	static constexpr int BUCKETS = (MAX_MAGNITUDE - MIN_MAGNITUDE) * SUB_BUCKETS;
+
+	std::atomic<uint64_t> _buckets[BUCKETS + 1] = {};
+	std::atomic<uint64_t> _sum{0};
+
+	static int index(uint64_t nanoseconds) {
+		if (nanoseconds <= (1ull << MIN_MAGNITUDE)) {
+			return 0;
+		}
+
+		// upper bounds are inclusive, so a value sitting on a bound belongs to the bucket below it
+		uint64_t value = nanoseconds - 1;
+
+		int magnitude = 63 - __builtin_clzll(value);
+		if (magnitude >= MAX_MAGNITUDE) {
+			return BUCKETS;
+		}
+
+		int sub = (int)(((value - (1ull << magnitude)) * SUB_BUCKETS) >> magnitude);
+
+		return (magnitude - MIN_MAGNITUDE) * SUB_BUCKETS + sub;
+	}
+
+	static double bound(int index) {
+		int magnitude = MIN_MAGNITUDE + index / SUB_BUCKETS;
+		int sub = index % SUB_BUCKETS;
+
+		return (double)(1ull << magnitude) * (1.0 + (double)(sub + 1) / SUB_BUCKETS) / 1e9;
+	}
+public:
+	void observe(std::chrono::nanoseconds duration) {
+		uint64_t nanoseconds = duration.count() > 0 ? duration.count() : 0;
+
+		_buckets[index(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+	}
+
+	void render(std::ostringstream &out, const std::string &name, const std::string &labels) const {
+		uint64_t cumulative = 0;
+		std::string prefix = labels.empty() ? "" : labels + ",";
+
+		for (int i = 0; i < BUCKETS; i++) {
+			cumulative += _buckets[i].load(std::memory_order_relaxed);
+			out << name << "_bucket{" << prefix << "le=\"" << bound(i) << "\"} " << cumulative << "\n";
+		}
+
+		cumulative += _buckets[BUCKETS].load(std::memory_order_relaxed);
+		out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+		out << name << "_sum{" << labels << "} " << (double)_sum.load(std::memory_order_relaxed) / 1e9 << "\n";
+		out << name << "_count{" << labels << "} " << cumulative << "\n";
+	}
+};
+
+class Metrics {
+public:
+	struct Route {
+		std::string name;
+		Histogram latency;
+		// responses by status class, index 0 holds aborted requests
+		std::atomic<uint64_t> responses[6] = {};
+	};
+private:
+	std::mutex _mutex;
+	std::map<std::string, std::unique_ptr<Route>> _routes;
+	std::map<std::string, std::unique_ptr<Histogram>> _queries;
+	std::map<std::string, std::unique_ptr<Histogram>> _storage;
+
+	template <typename T>
+	T &lookup(std::map<std::string, std::unique_ptr<T>> &family, const std::string &key) {
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto &entry = family[key];
+		if (!entry) {
+			entry = std::make_unique<T>();
+		}
+
+		return *entry;
+	}
+
+	static std::string escape(const std::string &value) {
+		std::string escaped;
+		for (char c : value) {
+			if (c == '\\' || c == '"') {
+				escaped += '\\';
+				escaped += c;
+			} else if (c == '\n') {
+				escaped += "\\n";
+			} else {
+				escaped += c;
+			}
+		}
+
+		return escaped;
+	}
+public:
+	std::atomic<uint64_t> bytesIn{0};
+	std::atomic<uint64_t> bytesOut{0};
+	std::atomic<uint64_t> stalls{0};
+	std::atomic<int64_t> uploads{0};
+	std::atomic<int64_t> downloads{0};
+	std::atomic<int64_t> subscribers{0};
+	std::atomic<uint64_t> throttled{0};
+	std::atomic<uint64_t> shed{0};
+
+	// counted by the background storage reconciliation
+	struct {
+		std::atomic<uint64_t> checked{0};
+		std::atomic<uint64_t> missing{0};
+		std::atomic<uint64_t> size{0};
+		std::atomic<uint64_t> hash{0};
+		std::atomic<uint64_t> orphans{0};
+		std::atomic<uint64_t> partials{0};
+		std::atomic<uint64_t> builds{0};
+	} reconciliation;
+
+	Route &route(const std::string &name) {
+		auto &route = lookup(_routes, name);
+		route.name = name;
+
+		return route;
+	}
+
+	Histogram &query(const std::string &sql) {
+		return lookup(_queries, sql);
+	}
+
+	Histogram &storage(const std::string &operation) {
+		return lookup(_storage, operation);
+	}
+
+	// Renders everything in the Prometheus text exposition format
+	std::string render() {
+		std::ostringstream out;
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		out.precision(12);
+
+		out << "# TYPE papyrus_http_request_duration_seconds histogram\n";
+		for (auto &[name, route] : _routes) {
+			route->latency.render(out, "papyrus_http_request_duration_seconds", "route=\"" + escape(name) + "\"");
+		}
+
+		out << "# TYPE papyrus_http_responses_total counter\n";
+		for (auto &[name, route] : _routes) {
+			for (int i = 0; i < 6; i++) {
+				std::string code = i ? std::to_string(i) + "xx" : "aborted";
+				out << "papyrus_http_responses_total{route=\"" << escape(name) << "\",code=\"" << code << "\"} " << route->responses[i].load(std::memory_order_relaxed) << "\n";
+			}
+		}
+
+		out << "# TYPE papyrus_sqlite_query_duration_seconds histogram\n";
+		for (auto &[sql, histogram] : _queries) {
+			histogram->render(out, "papyrus_sqlite_query_duration_seconds", "query=\"" + escape(sql) + "\"");
+		}
+
+		out << "# TYPE papyrus_storage_duration_seconds histogram\n";
+		for (auto &[operation, histogram] : _storage) {
+			histogram->render(out, "papyrus_storage_duration_seconds", "operation=\"" + escape(operation) + "\"");
+		}
+
+		out << "# TYPE papyrus_http_received_bytes_total counter\n";
+		out << "papyrus_http_received_bytes_total " << bytesIn.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_http_sent_bytes_total counter\n";
+		out << "papyrus_http_sent_bytes_total " << bytesOut.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_http_backpressure_stalls_total counter\n";
+		out << "papyrus_http_backpressure_stalls_total " << stalls.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_active_uploads gauge\n";
+		out << "papyrus_active_uploads " << uploads.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_active_downloads gauge\n";
+		out << "papyrus_active_downloads " << downloads.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_active_subscribers gauge\n";
+		out << "papyrus_active_subscribers " << subscribers.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_http_rejected_total counter\n";
+		out << "papyrus_http_rejected_total{reason=\"throttled\"} " << throttled.load(std::memory_order_relaxed) << "\n";
+		out << "papyrus_http_rejected_total{reason=\"shed\"} " << shed.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_reconcile_checked_total counter\n";
+		out << "papyrus_reconcile_checked_total " << reconciliation.checked.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_reconcile_problems_total counter\n";
+		out << "papyrus_reconcile_problems_total{problem=\"missing\"} " << reconciliation.missing.load(std::memory_order_relaxed) << "\n";
+		out << "papyrus_reconcile_problems_total{problem=\"size\"} " << reconciliation.size.load(std::memory_order_relaxed) << "\n";
+		out << "papyrus_reconcile_problems_total{problem=\"hash\"} " << reconciliation.hash.load(std::memory_order_relaxed) << "\n";
+		out << "# TYPE papyrus_reconcile_removed_total counter\n";
+		out << "papyrus_reconcile_removed_total{kind=\"orphan\"} " << reconciliation.orphans.load(std::memory_order_relaxed) << "\n";
+		out << "papyrus_reconcile_removed_total{kind=\"partial\"} " << reconciliation.partials.load(std::memory_order_relaxed) << "\n";
+		out << "papyrus_reconcile_removed_total{kind=\"build\"} " << reconciliation.builds.load(std::memory_order_relaxed) << "\n";
+
+		return out.str();
+	}
+};
+
+// Measures a block of code into a histogram once it goes out of scope
+class Stopwatch {
+private:
+	Histogram &_histogram;
+	std::chrono::steady_clock::time_point _start;
+public:
+	Stopwatch(Histogram &histogram) : _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+
+	~Stopwatch() {
+		_histogram.observe(std::chrono::steady_clock::now() - _start);
+	}
+};
+
+#endif // METRICS_CPP
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef POOL_CPP
+#define POOL_CPP
+
+// Runs jobs on a fixed number of threads, jobs still queued when it is destroyed are dropped
+class ThreadPool {
+private:
+	std::vector<std::thread> _threads;
+	std::deque<std::function<void()>> _jobs;
+	std::mutex _mutex;
+	std::condition_variable _available;
+	bool _stopping = false;
+
+	void work() {
+		while (true) {
+			std::function<void()> job;
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_available.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+
+				if (_stopping) {
+					return;
+				}
+
+				job = std::move(_jobs.front());
+				_jobs.pop_front();
+			}
+
+			job();
+		}
+	}
+public:
+	ThreadPool(size_t threads) {
+		for (size_t i = 0; i < std::max<size_t>(1, threads); i++) {
+			_threads.emplace_back([this]() { work(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+
+		_available.notify_all();
+
+		for (auto &thread : _threads) {
+			thread.join();
+		}
+	}
+
+	template <typename Job>
+	auto submit(Job job) -> std::future<decltype(job())> {
+		auto task = std::make_shared<std::packaged_task<decltype(job())()>>(std::move(job));
+		auto future = task->get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_jobs.emplace_back([task]() { (*task)(); });
+		}
+
+		_available.notify_one();
+
+		return future;
+	}
+};
+
+#endif // POOL_CPP
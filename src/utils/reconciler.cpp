@@ -0,0 +1,398 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <openssl/md5.h>
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include <utils/database.h>
+#include <utils/logger.cpp>
+#include <utils/metrics.cpp>
+#include <utils/pool.cpp>
+#include <utils/storage.cpp>
+
+#ifndef RECONCILER_CPP
+#define RECONCILER_CPP
+
+// Walks every ready build in the background and checks its artifact is in
+// storage with the right size (and, if enabled, hash), then removes files
+// nothing refers to and builds whose upload never came. Progress is kept in
+// the reconciliation table so a restart continues where the last pass stopped.
+class Reconciler {
+public:
+	struct Options {
+		size_t threads = 2;
+		std::chrono::seconds interval{6 * 60 * 60};
+		// files and pending builds younger than this are left alone, they may belong to an upload in progress
+		std::chrono::seconds grace{24 * 60 * 60};
+		// bytes per second read for hash verification, 0 to only check sizes. Artifacts
+		// finalized before Storage::hashVersion 1 have the md5 of their whole 1 KiB
+		// chunks only, those are verified against that and remembered as version 0
+		double verifyRate = 0;
+	};
+private:
+	enum class Problem {
+		NONE,
+		MISSING,
+		SIZE,
+		HASH
+	};
+
+	struct Artifact {
+		std::string md5;
+		// empty for builds uploaded before artifacts were tracked
+		std::string encoding;
+		int64_t storedSize = -1;
+		// -1 when not known yet
+		int hashVersion = -1;
+	};
+
+	struct Outcome {
+		Problem problem = Problem::NONE;
+		uintmax_t size = 0;
+		// the hash version verification found the artifact to have, -1 if it wasn't hashed
+		int hashVersion = -1;
+	};
+
+	static constexpr int _batch = 256;
+
+	DB _database;
+	Storage &_storage;
+	Metrics &_metrics;
+	Options _options;
+	ThreadPool _pool;
+
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::atomic<bool> _stopping{false};
+
+	// earliest time the next verified chunk may be read, shared by all workers
+	std::mutex _budgetMutex;
+	std::chrono::steady_clock::time_point _budget = std::chrono::steady_clock::now();
+
+	void spend(size_t bytes) {
+		std::chrono::steady_clock::time_point until;
+
+		{
+			std::lock_guard<std::mutex> lock(_budgetMutex);
+
+			_budget = std::max(_budget, std::chrono::steady_clock::now()) + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(bytes / _options.verifyRate));
+			until = _budget;
+		}
+
+		std::this_thread::sleep_until(until);
+	}
+
+	static std::string hex(MD5_CTX &context) {
+		unsigned char hash[MD5_DIGEST_LENGTH];
+		MD5_Final(hash, &context);
+
+		std::string hex;
+		for (auto byte : hash) {
+			char c[3];
+			snprintf(c, sizeof(c), "%02x", byte);
+			hex += c;
+		}
+
+		return hex;
+	}
+
+	// The md5 of the whole content and the one finalize() computed before hashVersion 1
+	std::pair<std::string, std::string> digest(const Artifact &artifact) {
+		auto reader = _storage.retrieve(artifact.md5, artifact.encoding == "gzip" ? "gzip" : "identity", true);
+
+		MD5_CTX whole, chunks;
+		MD5_Init(&whole);
+		MD5_Init(&chunks);
+
+		// a multiple of 1 KiB, only the last read can be short
+		std::vector<char> buffer(64 * 1024);
+		std::streamsize length;
+
+		while (!_stopping && (length = reader.read(buffer.data(), buffer.size())) > 0) {
+			spend(length);
+			MD5_Update(&whole, buffer.data(), length);
+			MD5_Update(&chunks, buffer.data(), length - length % 1024);
+		}
+
+		if (_stopping) {
+			return { artifact.md5, artifact.md5 };
+		}
+
+		return { hex(whole), hex(chunks) };
+	}
+
+	// Runs on the pool, only touches the file system
+	Outcome check(const Artifact &artifact) {
+		Outcome outcome;
+		std::error_code error;
+
+		outcome.size = std::filesystem::file_size(_storage.get() + "/" + artifact.md5 + (artifact.encoding == "gzip" ? ".gz" : ""), error);
+
+		if (error) {
+			outcome.problem = Problem::MISSING;
+		} else if (artifact.storedSize >= 0 && outcome.size != (uintmax_t)artifact.storedSize) {
+			outcome.problem = Problem::SIZE;
+		} else if (_options.verifyRate > 0) {
+			auto [whole, chunks] = digest(artifact);
+
+			if (artifact.hashVersion != 0 && whole == artifact.md5) {
+				outcome.hashVersion = Storage::hashVersion;
+			} else if (artifact.hashVersion != Storage::hashVersion && chunks == artifact.md5) {
+				outcome.hashVersion = 0;
+			} else {
+				outcome.problem = Problem::HASH;
+			}
+		}
+
+		return outcome;
+	}
+
+	int64_t cursor() {
+		SQLite::Statement query(_database.get(), "SELECT value FROM reconciliation WHERE name = 'cursor';");
+		auto results = _database.query(query);
+
+		return results.size() ? std::stoll(results.front()["value"]) : 0;
+	}
+
+	void cursor(int64_t id) {
+		SQLite::Statement query(_database.get(), "INSERT OR REPLACE INTO reconciliation (name, value) VALUES ('cursor', ?);");
+		query.bind(1, id);
+
+		_database.exec(query);
+	}
+
+	// Checks the builds after the cursor in batches, returns false when stopped before the end
+	bool pass() {
+		int64_t last = cursor();
+
+		while (!_stopping) {
+			SQLite::Statement query(_database.get(), "SELECT builds.id, builds.md5, artifacts.encoding, artifacts.stored_size, artifacts.hash_version FROM builds LEFT JOIN artifacts ON artifacts.md5 = builds.md5 WHERE builds.ready = 1 AND builds.id > ? ORDER BY builds.id ASC LIMIT ?;");
+			query.bind(1, last);
+			query.bind(2, _batch);
+
+			auto rows = _database.query(query);
+
+			if (rows.empty()) {
+				cursor(0);
+				return true;
+			}
+
+			// builds of identical uploads share one file, it only has to be checked once
+			std::map<std::string, std::pair<Artifact, std::future<Outcome>>> checks;
+
+			for (auto &row : rows) {
+				if (checks.count(row["md5"])) {
+					continue;
+				}
+
+				Artifact artifact;
+				artifact.md5 = row["md5"];
+				artifact.encoding = row["encoding"];
+				artifact.storedSize = row["stored_size"].empty() ? -1 : std::stoll(row["stored_size"]);
+				artifact.hashVersion = row["hash_version"].empty() ? -1 : std::stoi(row["hash_version"]);
+
+				auto future = _pool.submit([this, artifact]() { return check(artifact); });
+				checks.emplace(artifact.md5, std::make_pair(artifact, std::move(future)));
+			}
+
+			std::map<std::string, Outcome> outcomes;
+
+			for (auto &[md5, entry] : checks) {
+				outcomes[md5] = entry.second.get();
+			}
+
+			// hashing stops early on shutdown, so the batch has to be checked again
+			if (_stopping) {
+				return false;
+			}
+
+			// only written once the batch is done so the write lock isn't held while hashing
+			SQLite::Transaction transaction(_database.get());
+
+			for (auto &[md5, outcome] : outcomes) {
+				auto &artifact = checks.at(md5).first;
+
+				_metrics.reconciliation.checked.fetch_add(1, std::memory_order_relaxed);
+
+				switch (outcome.problem) {
+					case Problem::NONE:
+						if (outcome.hashVersion == 0 && artifact.hashVersion != 0) {
+							Logger::level(Level::INFO).log("Artifact " + md5 + " matches the hash it was published with before every byte was hashed");
+						}
+
+						if (artifact.encoding.empty()) {
+							query = SQLite::Statement(_database.get(), "INSERT OR IGNORE INTO artifacts (md5, size, encoding, stored_size, hash_version) VALUES (?, ?, 'identity', ?, ?);");
+							query.bind(1, md5);
+							query.bind(2, (int64_t)outcome.size);
+							query.bind(3, (int64_t)outcome.size);
+
+							if (outcome.hashVersion >= 0) {
+								query.bind(4, outcome.hashVersion);
+							}
+
+							_database.exec(query);
+						} else if (outcome.hashVersion >= 0 && artifact.hashVersion < 0) {
+							query = SQLite::Statement(_database.get(), "UPDATE artifacts SET hash_version = ? WHERE md5 = ?;");
+							query.bind(1, outcome.hashVersion);
+							query.bind(2, md5);
+
+							_database.exec(query);
+						}
+						break;
+					case Problem::MISSING:
+						_metrics.reconciliation.missing.fetch_add(1, std::memory_order_relaxed);
+						Logger::level(Level::WARN).log("Artifact " + md5 + " is missing from storage");
+						break;
+					case Problem::SIZE:
+						_metrics.reconciliation.size.fetch_add(1, std::memory_order_relaxed);
+						Logger::level(Level::WARN).log("Artifact " + md5 + " is " + std::to_string(outcome.size) + " bytes, expected " + std::to_string(artifact.storedSize));
+						break;
+					case Problem::HASH:
+						_metrics.reconciliation.hash.fetch_add(1, std::memory_order_relaxed);
+						Logger::level(Level::ERROR).log("Artifact " + md5 + " does not match its hash");
+						break;
+				}
+			}
+
+			last = std::stoll(rows.back()["id"]);
+			cursor(last);
+
+			transaction.commit();
+		}
+
+		return false;
+	}
+
+	static bool named(const std::string &name, const char *characters, size_t length = 0) {
+		return !name.empty() && (!length || name.size() == length) && name.find_first_not_of(characters) == std::string::npos;
+	}
+
+	// Removes unreferenced artifacts, leftover partial uploads and builds whose upload never finished
+	void cleanup() {
+		auto cutoff = std::filesystem::file_time_type::clock::now() - _options.grace;
+
+		std::unordered_set<std::string> referenced;
+		SQLite::Statement query(_database.get(), "SELECT DISTINCT md5 FROM builds WHERE md5 != '';");
+
+		for (auto &row : _database.query(query)) {
+			referenced.insert(row["md5"]);
+		}
+
+		// partial uploads are named after their build id, finished ones after their md5
+		std::error_code error;
+
+		for (auto &entry : std::filesystem::directory_iterator(_storage.get(), error)) {
+			if (_stopping) {
+				return;
+			}
+
+			if (!entry.is_regular_file(error)) {
+				continue;
+			}
+
+			auto name = entry.path().filename().string();
+			auto stem = name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0 ? name.substr(0, name.size() - 3) : name;
+			bool recent = entry.last_write_time(error) > cutoff || error;
+
+			if (recent) {
+				continue;
+			}
+
+			if (named(stem, "0123456789")) {
+				if (std::filesystem::remove(entry.path(), error)) {
+					_metrics.reconciliation.partials.fetch_add(1, std::memory_order_relaxed);
+					Logger::level(Level::INFO).log("Removed partial upload " + name);
+				}
+			} else if (named(stem, "0123456789abcdef", 32) && !referenced.count(stem)) {
+				if (std::filesystem::remove(entry.path(), error)) {
+					_metrics.reconciliation.orphans.fetch_add(1, std::memory_order_relaxed);
+					Logger::level(Level::INFO).log("Removed orphaned artifact " + name);
+				}
+			}
+		}
+
+		// builds.created is set by the server, builds.timestamp comes from the client and can be anything
+		auto before = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() - _options.grace).time_since_epoch()).count();
+
+		query = SQLite::Statement(_database.get(), "SELECT id FROM builds WHERE ready = 0 AND created < ?;");
+		query.bind(1, (int64_t)before);
+
+		auto stale = _database.query(query);
+
+		SQLite::Transaction transaction(_database.get());
+
+		for (auto &row : stale) {
+			// checked inside the transaction, an upload that starts after this fails to finalize instead
+			if (std::filesystem::exists(_storage.get() + "/" + row["id"], error)) {
+				continue;
+			}
+
+			query = SQLite::Statement(_database.get(), "DELETE FROM commits WHERE build_id = ?;");
+			query.bind(1, std::stoi(row["id"]));
+			_database.exec(query);
+
+			query = SQLite::Statement(_database.get(), "DELETE FROM builds WHERE id = ? AND ready = 0;");
+			query.bind(1, std::stoi(row["id"]));
+
+			if (_database.exec(query)) {
+				_metrics.reconciliation.builds.fetch_add(1, std::memory_order_relaxed);
+				Logger::level(Level::INFO).log("Removed build " + row["id"] + " which was never uploaded");
+			}
+		}
+
+		query = SQLite::Statement(_database.get(), "DELETE FROM artifacts WHERE md5 NOT IN (SELECT md5 FROM builds);");
+		_database.exec(query);
+
+		transaction.commit();
+	}
+
+	void run() {
+		while (!_stopping) {
+			auto start = std::chrono::steady_clock::now();
+
+			try {
+				if (pass()) {
+					cleanup();
+
+					Logger::level(Level::INFO).log("Reconciled storage in " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count()) + "s");
+				}
+			} catch (std::exception &e) {
+				Logger::level(Level::ERROR).log("Reconciliation failed: " + std::string(e.what()));
+			}
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait_for(lock, _options.interval, [this]() { return _stopping.load(); });
+		}
+	}
+public:
+	Reconciler(const std::string &database, Storage &storage, Metrics &metrics, Options options) : _database(database, 5000), _storage(storage), _metrics(metrics), _options(options), _pool(options.threads) {}
+
+	~Reconciler() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+
+		_wake.notify_all();
+
+		if (_thread.joinable()) {
+			_thread.join();
+		}
+	}
+
+	void start() {
+		_thread = std::thread([this]() { run(); });
+	}
+};
+
+#endif // RECONCILER_CPP
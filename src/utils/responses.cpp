@@ -0,0 +1,245 @@
+#include <map>
+#include <optional>
+#include <string>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+#include <nlohmann/json.hpp>
+
+#include <utils/database.h>
+#include <utils/trace.cpp>
+
+#ifndef RESPONSES_CPP
+#define RESPONSES_CPP
+
+// Builds the bodies of the read API
+class Responses {
+private:
+	using json = nlohmann::json;
+
+	// The commit as it was submitted, rows without raw are rebuilt from their columns
+	static json commitOf(std::map<std::string, std::string> &row) {
+		if (!row["raw"].empty()) {
+			return json::parse(row["raw"]);
+		}
+
+		auto commit = json::object();
+
+		commit["author"] = row["author"];
+		commit["email"] = row["email"];
+		commit["description"] = row["description"];
+		commit["hash"] = row["hash"];
+		commit["timestamp"] = std::stoll(row["timestamp"]);
+
+		return commit;
+	}
+
+	// Groups commit rows by the build they belong to, keeping the order they were submitted in
+	static std::map<std::string, json> commitsByBuild(DB &database, SQLite::Statement &query) {
+		std::map<std::string, json> commits;
+
+		for (auto row : database.query(query)) {
+			auto commit = commitOf(row);
+
+			auto &list = commits[row["build_id"]];
+			if (list.is_null()) {
+				list = json::array();
+			}
+
+			list.push_back(commit);
+		}
+
+		return commits;
+	}
+
+	static json commitsOf(std::map<std::string, json> &commits, const std::string &buildId) {
+		auto it = commits.find(buildId);
+		if (it != commits.end()) {
+			return it->second;
+		}
+
+		return json::array();
+	}
+
+	static json buildOf(std::map<std::string, std::string> &row, const std::string &project, const std::string &version, std::map<std::string, json> &commits) {
+		auto build = json::object();
+
+		build["project"] = project;
+		build["version"] = version;
+		build["build"] = row["build"];
+		build["result"] = row["result"];
+		build["timestamp"] = std::stol(row["timestamp"]);
+		build["duration"] = std::stoi(row["duration"]);
+		build["md5"] = row["md5"];
+		build["sha256"] = row["sha256"];
+		build["sha512"] = row["sha512"];
+		build["commits"] = commitsOf(commits, row["id"]);
+		build["metadata"] = json::parse(row["metadata"]);
+
+		return build;
+	}
+public:
+	// GET /v2
+	static json projects(DB &database) {
+		Span fetch("db.fetch");
+
+		SQLite::Statement query(database.get(), "SELECT name FROM projects");
+		auto rows = database.query(query);
+
+		fetch.end();
+		Span building("json.build");
+
+		auto json = json::object();
+
+		json["projects"] = json::array();
+
+		for (auto row : rows) {
+			json["projects"].push_back(row["name"]);
+		}
+
+		return json;
+	}
+
+	// GET /v2/:project
+	static json versions(DB &database, const std::string &project) {
+		Span fetch("db.fetch");
+
+		SQLite::Statement query(database.get(), "SELECT name FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?)");
+		query.bind(1, project);
+
+		auto rows = database.query(query);
+
+		fetch.end();
+		Span building("json.build");
+
+		auto json = json::object();
+
+		json["project"] = project;
+		json["versions"] = json::array();
+
+		for (auto row : rows) {
+			json["versions"].push_back(row["name"]);
+		}
+
+		return json;
+	}
+
+	// GET /v2/:project/:version, empty when the version has no ready builds
+	static std::optional<json> builds(DB &database, const std::string &project, const std::string &version) {
+		Span fetch("db.fetch");
+
+		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND ready = 1 ORDER BY id ASC");
+		query.bind(1, project);
+		query.bind(2, version);
+
+		auto results = database.query(query);
+
+		if (!results.size()) {
+			return std::nullopt;
+		}
+
+		query = SQLite::Statement(database.get(), "SELECT build_id, author, email, description, hash, timestamp, raw FROM commits WHERE build_id IN (SELECT id FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND ready = 1) ORDER BY id ASC");
+		query.bind(1, project);
+		query.bind(2, version);
+
+		auto commits = commitsByBuild(database, query);
+
+		fetch.end();
+		Span building("json.build");
+
+		auto json = json::object();
+
+		json["project"] = project;
+		json["version"] = version;
+
+		json["builds"] = json::object();
+		json["builds"]["all"] = json::array();
+
+		for (auto row : results) {
+			json["builds"]["all"].push_back(buildOf(row, project, version, commits));
+		}
+
+		json["builds"]["latest"] = json["builds"]["all"].back();
+
+		return json;
+	}
+
+	// GET /v2/:project/:version/:build, build can be "latest"
+	static std::optional<json> build(DB &database, const std::string &project, const std::string &version, const std::string &build) {
+		Span fetch("db.fetch");
+
+		SQLite::Statement query(database.get(), "SELECT * FROM builds WHERE version_id = (SELECT id FROM versions WHERE project_id = (SELECT id FROM projects WHERE name = ?) AND name = ?) AND (build = ? OR ? = 'latest') AND ready = 1 ORDER BY id DESC LIMIT 1");
+		query.bind(1, project);
+		query.bind(2, version);
+		query.bind(3, build);
+		query.bind(4, build);
+
+		auto results = database.query(query);
+
+		if (!results.size()) {
+			return std::nullopt;
+		}
+
+		auto row = results.front();
+
+		query = SQLite::Statement(database.get(), "SELECT build_id, author, email, description, hash, timestamp, raw FROM commits WHERE build_id = ? ORDER BY id ASC");
+		query.bind(1, std::stoi(row["id"]));
+
+		auto commits = commitsByBuild(database, query);
+
+		fetch.end();
+		Span building("json.build");
+
+		return buildOf(row, project, version, commits);
+	}
+
+	// GET /v2/:project/commit/:hash, every ready build containing the commit, once even if it lists the commit twice
+	static std::optional<json> commit(DB &database, const std::string &project, const std::string &hash) {
+		Span fetch("db.fetch");
+
+		SQLite::Statement query(database.get(), "SELECT versions.name AS version, builds.build, builds.result, builds.timestamp, builds.duration, builds.md5, builds.sha256, builds.sha512, commits.author, commits.email, commits.description, commits.hash, commits.timestamp AS commit_timestamp, commits.raw, MIN(commits.id) FROM commits INNER JOIN builds ON builds.id = commits.build_id INNER JOIN versions ON versions.id = builds.version_id WHERE commits.hash = ? AND versions.project_id = (SELECT id FROM projects WHERE name = ?) AND builds.ready = 1 GROUP BY builds.id ORDER BY builds.id ASC");
+		query.bind(1, hash);
+		query.bind(2, project);
+
+		auto results = database.query(query);
+
+		if (!results.size()) {
+			return std::nullopt;
+		}
+
+		fetch.end();
+		Span building("json.build");
+
+		auto first = results.front();
+
+		auto json = json::object();
+
+		json["project"] = project;
+		first["timestamp"] = first["commit_timestamp"];
+		json["commit"] = commitOf(first);
+
+		json["builds"] = json::object();
+		json["builds"]["all"] = json::array();
+
+		for (auto row : results) {
+			auto build = json::object();
+
+			build["project"] = project;
+			build["version"] = row["version"];
+			build["build"] = row["build"];
+			build["result"] = row["result"];
+			build["timestamp"] = std::stol(row["timestamp"]);
+			build["duration"] = std::stoi(row["duration"]);
+			build["md5"] = row["md5"];
+			build["sha256"] = row["sha256"];
+			build["sha512"] = row["sha512"];
+
+			json["builds"]["all"].push_back(build);
+		}
+
+		json["builds"]["first"] = json["builds"]["all"].front();
+
+		return json;
+	}
+};
+
+#endif // RESPONSES_CPP
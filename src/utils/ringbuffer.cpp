@@ -0,0 +1,95 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#ifndef RINGBUFFER_CPP
+#define RINGBUFFER_CPP
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov), pushing
+// onto a full buffer fails instead of blocking
+template <typename T>
+class RingBuffer {
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> _cells;
+	size_t _mask;
+
+	alignas(64) std::atomic<size_t> _enqueue{0};
+	alignas(64) std::atomic<size_t> _dequeue{0};
+public:
+	// capacity gets rounded up to the next power of two
+	RingBuffer(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+
+		_cells = std::make_unique<Cell[]>(size);
+		_mask = size - 1;
+
+		for (size_t i = 0; i < size; i++) {
+			_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool push(T &&value) {
+		Cell *cell;
+		size_t position = _enqueue.load(std::memory_order_relaxed);
+
+		while (true) {
+			cell = &_cells[position & _mask];
+
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+			if (difference == 0) {
+				if (_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = _enqueue.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::move(value);
+		cell->sequence.store(position + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool pop(T &value) {
+		Cell *cell;
+		size_t position = _dequeue.load(std::memory_order_relaxed);
+
+		while (true) {
+			cell = &_cells[position & _mask];
+
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+			if (difference == 0) {
+				if (_dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = _dequeue.load(std::memory_order_relaxed);
+			}
+		}
+
+		value = std::move(cell->data);
+		cell->sequence.store(position + _mask + 1, std::memory_order_release);
+
+		return true;
+	}
+};
+
+#endif // RINGBUFFER_CPP
@@ -4,13 +4,26 @@
 #include <fstream>
 #include <sys/stat.h>
 #include <filesystem>
+#include <memory>
+#include <vector>
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <zlib.h>
+
+#include <utils/trace.cpp>
+
+#ifndef STORAGE_CPP
+#define STORAGE_CPP
 
 class Storage {
 private:
 	std::string _path;
+	bool _compress;
+
+	// compressing stops once this much input saved less than a tenth, most
+	// artifacts are jars which are already deflated
+	static constexpr uintmax_t _probe = 1024 * 1024;
 
 	std::string bufToHex(const unsigned char *buffer, size_t length) {
 		std::string hex;
@@ -22,8 +35,111 @@ private:
 
 		return hex;
 	}
+
+	bool deflateInto(z_stream &stream, std::ofstream &output, const char *input, size_t length, int flush) {
+		char buffer[64 * 1024];
+
+		stream.next_in = (Bytef *)input;
+		stream.avail_in = length;
+
+		do {
+			stream.next_out = (Bytef *)buffer;
+			stream.avail_out = sizeof(buffer);
+
+			if (deflate(&stream, flush) == Z_STREAM_ERROR) {
+				return false;
+			}
+
+			output.write(buffer, sizeof(buffer) - stream.avail_out);
+		} while (stream.avail_out == 0);
+
+		return (bool)output;
+	}
 public:
-	Storage(const std::string &path) : _path(path) {
+	// Stored with every artifact finalize() hashes. Before version 1 only whole 1 KiB
+	// chunks were hashed, so the last size % 1024 bytes weren't part of the hashes.
+	// Those builds keep the hashes (and file names) they were published with.
+	static constexpr int hashVersion = 1;
+
+	// Reads a stored artifact, inflating it on the fly when it is gzipped at rest
+	class Reader {
+	private:
+		struct InflateEnd {
+			void operator()(z_stream *stream) {
+				inflateEnd(stream);
+				delete stream;
+			}
+		};
+
+		std::ifstream _file;
+		std::unique_ptr<z_stream, InflateEnd> _inflate;
+		std::vector<char> _input;
+		bool _ended = false;
+	public:
+		Reader() = default;
+
+		Reader(const std::string &path, bool inflate) : _file(path, std::ios::binary) {
+			if (inflate && _file.is_open()) {
+				auto stream = new z_stream{};
+
+				if (inflateInit2(stream, 15 + 16) != Z_OK) {
+					delete stream;
+					_file.close();
+
+					return;
+				}
+
+				_inflate.reset(stream);
+				_input.resize(64 * 1024);
+			}
+		}
+
+		bool is_open() const {
+			return _file.is_open();
+		}
+
+		void close() {
+			_file.close();
+			_inflate.reset();
+		}
+
+		// Fills up to length bytes, returns less only at the end of the content (or a corrupt file)
+		std::streamsize read(char *buffer, std::streamsize length) {
+			if (!_inflate) {
+				_file.read(buffer, length);
+
+				return _file.gcount();
+			}
+
+			_inflate->next_out = (Bytef *)buffer;
+			_inflate->avail_out = length;
+
+			while (_inflate->avail_out && !_ended) {
+				if (!_inflate->avail_in) {
+					_file.read(_input.data(), _input.size());
+					if (!_file.gcount()) {
+						break;
+					}
+
+					_inflate->next_in = (Bytef *)_input.data();
+					_inflate->avail_in = _file.gcount();
+				}
+
+				int result = inflate(_inflate.get(), Z_NO_FLUSH);
+
+				if (result == Z_STREAM_END) {
+					_ended = true;
+				} else if (result != Z_OK && result != Z_BUF_ERROR) {
+					break;
+				}
+			}
+
+			return length - _inflate->avail_out;
+		}
+	};
+
+	// with compress, artifacts that shrink are kept gzipped as <md5>.gz instead of <md5>
+	Storage(const std::string &path, bool compress = false) : _path(path), _compress(compress) {
 		struct stat info;
 		if (stat(path.c_str(), &info) != 0) {
 			std::filesystem::create_directories(path);
@@ -38,15 +154,20 @@ public:
 		return std::ofstream(_path + "/" + filename);
 	}
 
+	// Removes the file along with its compressed variant
 	void remove(const std::string &filename) {
-		if (std::filesystem::exists(_path + "/" + filename)) {
-			std::filesystem::remove(_path + "/" + filename);
+		for (auto &name : { filename, filename + ".gz" }) {
+			if (std::filesystem::exists(_path + "/" + name)) {
+				std::filesystem::remove(_path + "/" + name);
+			}
 		}
 	}
 
-	// Does the final touches (hashing it to md5, sha256, sha512)
+	// Does the final touches (hashing it to md5, sha256, sha512 and compressing it when enabled),
+	// also reports the size, the stored size and the encoding ("gzip" or "identity") it was kept in
 	std::map<std::string, std::string> finalize(const std::string &filename) {
 		std::map<std::string, std::string> hashes;
+		Span hashing("upload.hash");
 
 		std::ifstream file(_path + "/" + filename, std::ios::binary);
 		if (!file.is_open()) {
@@ -62,35 +183,84 @@ public:
 		SHA512_CTX sha512Context;
 		SHA512_Init(&sha512Context);
 
-		char buffer[1024];
-		while (file.read(buffer, sizeof(buffer))) {
-			MD5_Update(&md5Context, buffer, sizeof(buffer));
-			SHA256_Update(&sha256Context, buffer, sizeof(buffer));
-			SHA512_Update(&sha512Context, buffer, sizeof(buffer));
+		// the hashes are always of the original content, compressing happens in the same pass
+		z_stream deflater {};
+		std::ofstream compressed;
+		bool compressing = _compress && deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+		if (compressing) {
+			compressed.open(_path + "/" + filename + ".gz", std::ios::binary | std::ios::trunc);
+		}
+
+		uintmax_t size = 0;
+
+		// every byte is hashed, see hashVersion
+		std::vector<char> buffer(64 * 1024);
+		while (file.read(buffer.data(), buffer.size()) || file.gcount()) {
+			MD5_Update(&md5Context, buffer.data(), file.gcount());
+			SHA256_Update(&sha256Context, buffer.data(), file.gcount());
+			SHA512_Update(&sha512Context, buffer.data(), file.gcount());
+
+			size += file.gcount();
+
+			if (compressing) {
+				compressing = deflateInto(deflater, compressed, buffer.data(), file.gcount(), Z_NO_FLUSH);
+
+				if (size >= _probe && deflater.total_out > size - size / 10) {
+					compressing = false;
+				}
+			}
 		}
 
-		MD5_Final((unsigned char *)buffer, &md5Context);
-		hashes["md5"] = bufToHex((unsigned char *)buffer, MD5_DIGEST_LENGTH);
+		if (compressing) {
+			compressing = deflateInto(deflater, compressed, nullptr, 0, Z_FINISH) && deflater.total_out < size - size / 10;
+		}
+
+		if (_compress) {
+			deflateEnd(&deflater);
+			compressed.close();
+		}
+
+		MD5_Final((unsigned char *)buffer.data(), &md5Context);
+		hashes["md5"] = bufToHex((unsigned char *)buffer.data(), MD5_DIGEST_LENGTH);
 
-		SHA256_Final((unsigned char *)buffer, &sha256Context);
-		hashes["sha256"] = bufToHex((unsigned char *)buffer, SHA256_DIGEST_LENGTH);
+		SHA256_Final((unsigned char *)buffer.data(), &sha256Context);
+		hashes["sha256"] = bufToHex((unsigned char *)buffer.data(), SHA256_DIGEST_LENGTH);
 
-		SHA512_Final((unsigned char *)buffer, &sha512Context);
-		hashes["sha512"] = bufToHex((unsigned char *)buffer, SHA512_DIGEST_LENGTH);
+		SHA512_Final((unsigned char *)buffer.data(), &sha512Context);
+		hashes["sha512"] = bufToHex((unsigned char *)buffer.data(), SHA512_DIGEST_LENGTH);
 
 		file.close();
+		hashing.end();
 
-		if (std::filesystem::exists(_path + "/" + hashes["md5"])) {
-			std::filesystem::remove(_path + "/" + hashes["md5"]);
+		Span renaming("upload.rename");
+
+		remove(hashes["md5"]);
+
+		if (compressing) {
+			std::filesystem::rename(_path + "/" + filename + ".gz", _path + "/" + hashes["md5"] + ".gz");
+			std::filesystem::remove(_path + "/" + filename);
+		} else {
+			std::filesystem::remove(_path + "/" + filename + ".gz");
+
+			std::filesystem::rename(_path + "/" + filename, _path + "/" + hashes["md5"]);
 		}
 
-		std::filesystem::rename(_path + "/" + filename, _path + "/" + hashes["md5"]);
+		hashes["encoding"] = compressing ? "gzip" : "identity";
+		hashes["size"] = std::to_string(size);
+		hashes["stored_size"] = std::to_string(compressing ? (uintmax_t)deflater.total_out : size);
 
 		return hashes;
 	}
 
-	std::ifstream retrieve(const std::string &filename) {
-		return std::ifstream(_path + "/" + filename);
+	// encoding is the one the artifact was stored with, a gzipped artifact is
+	// read as is with inflate = false and decompressed otherwise
+	Reader retrieve(const std::string &md5, const std::string &encoding = "identity", bool inflate = false) {
+		if (encoding == "gzip") {
+			return Reader(_path + "/" + md5 + ".gz", inflate);
+		}
+
+		return Reader(_path + "/" + md5, false);
 	}
 
 	uintmax_t size(const std::string &filename) {
@@ -98,4 +268,11 @@ public:
 
 		return stat;
 	}
-};
\ No newline at end of file
+
+	// Sets error instead of throwing when the file is missing
+	uintmax_t size(const std::string &filename, std::error_code &error) {
+		return std::filesystem::file_size(_path + "/" + filename, error);
+	}
+};
+
+#endif // STORAGE_CPP
@@ -0,0 +1,182 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+#ifndef TRACE_CPP
+#define TRACE_CPP
+
+// Collects timed spans into a ring buffer per thread and exports them in
+// the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+class Tracer {
+private:
+	struct Record {
+		const char *name = nullptr;
+		uint64_t request = 0;
+		int64_t start = 0;
+		int64_t duration = 0;
+	};
+
+	struct Buffer {
+		std::mutex mutex;
+		std::vector<Record> records;
+		size_t next = 0;
+		bool wrapped = false;
+		uint32_t thread = 0;
+	};
+
+	std::mutex _mutex;
+	std::vector<std::shared_ptr<Buffer>> _buffers;
+	std::atomic<bool> _enabled{true};
+	size_t _capacity = 65536;
+	std::chrono::steady_clock::time_point _epoch = std::chrono::steady_clock::now();
+
+	Buffer &local() {
+		thread_local std::shared_ptr<Buffer> buffer = [this]() {
+			auto buffer = std::make_shared<Buffer>();
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			buffer->records.resize(_capacity);
+			buffer->thread = _buffers.size() + 1;
+			_buffers.push_back(buffer);
+
+			return buffer;
+		}();
+
+		return *buffer;
+	}
+
+	static uint64_t &current() {
+		thread_local uint64_t request = 0;
+
+		return request;
+	}
+public:
+	static Tracer &get() {
+		static Tracer tracer;
+
+		return tracer;
+	}
+
+	// Has to run before any thread records a span
+	void configure(bool enabled, size_t capacity) {
+		_enabled.store(enabled, std::memory_order_relaxed);
+		_capacity = capacity ? capacity : 1;
+	}
+
+	bool enabled() const {
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count();
+	}
+
+	// Request the spans recorded on this thread are attributed to
+	static uint64_t request() {
+		return current();
+	}
+
+	static void request(uint64_t id) {
+		current() = id;
+	}
+
+	void record(const char *name, uint64_t request, int64_t start, int64_t end) {
+		auto &buffer = local();
+		std::lock_guard<std::mutex> lock(buffer.mutex);
+
+		auto &record = buffer.records[buffer.next];
+
+		record.name = name;
+		record.request = request;
+		record.start = start;
+		record.duration = end - start;
+
+		if (++buffer.next == buffer.records.size()) {
+			buffer.next = 0;
+			buffer.wrapped = true;
+		}
+	}
+
+	std::string chrome() {
+		std::ostringstream out;
+		bool first = true;
+
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto &buffer : _buffers) {
+			std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+
+			size_t count = buffer->wrapped ? buffer->records.size() : buffer->next;
+			size_t start = buffer->wrapped ? buffer->next : 0;
+
+			for (size_t i = 0; i < count; i++) {
+				auto &record = buffer->records[(start + i) % buffer->records.size()];
+
+				out << (first ? "" : ",")
+					<< "{\"name\":\"" << record.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread
+					<< ",\"ts\":" << record.start / 1000 << "." << record.start % 1000 / 100
+					<< ",\"dur\":" << record.duration / 1000 << "." << record.duration % 1000 / 100
+					<< ",\"args\":{\"request\":" << record.request << "}}";
+
+				first = false;
+			}
+		}
+
+		out << "]}";
+
+		return out.str();
+	}
+
+	// Writes the trace to path whenever the process receives SIGUSR1, has to
+	// be called before any other thread is started so they inherit the mask
+	void dumpOnSignal(const std::string &path, std::function<void(const std::string &)> done) {
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+		std::thread([this, signals, path, done]() {
+			int signal;
+			while (sigwait(&signals, &signal) == 0) {
+				std::ofstream(path, std::ios::trunc) << chrome();
+				done(path);
+			}
+		}).detach();
+	}
+};
+
+// Times the enclosing scope (or until end()) as one span of the current request
+class Span {
+private:
+	const char *_name;
+	uint64_t _request;
+	int64_t _start;
+	bool _open;
+public:
+	Span(const char *name) : _name(name), _request(Tracer::request()), _open(Tracer::get().enabled()) {
+		_start = _open ? Tracer::get().now() : 0;
+	}
+
+	~Span() {
+		end();
+	}
+
+	void end() {
+		if (_open) {
+			_open = false;
+			Tracer::get().record(_name, _request, _start, Tracer::get().now());
+		}
+	}
+};
+
+#endif // TRACE_CPP